@@ -1,1369 +1,7223 @@
 #include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <charconv>
+#include <climits>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <vector>
 #include <string>
+#include <array>
+#include <algorithm>
 #include <ctime>
+#include <map>
+#include <unordered_map>
+#include <queue>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <chrono>
+#include <atomic>
+#include <csignal>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <time.h>
 #define infinity 10000000
 #define Readahead 4
+#define farDist 0xFFFF
+#define LazyRoutes 4096
+#define RouteRows 1024
+#define SymmetryLimit 1024
+#define RenumberQubits 1024
+#define SocketTimeout 30
 #define cof 0.02
+#define Extended 20
+#define extWeight 0.5
+#define decayStep 0.001
 
 using namespace std;
 
-class HardwareA
+struct CostModel
 {
-protected:
-    int qubitNum;
+    double ctScale;
 
-    int edgeNum;
+    int readahead;
 
-    bool isUniDirection;
+    int cx;
 
-    vector<vector<bool>> archMatrix;
+    int cxReversed;
 
-    vector<vector<int>> distMatrix;
+    int bridge;
 
-    vector<vector<int>> routeMatrix;
+    int bridgeReversed;
 
-    vector<int> outdeg;
+    int swap;
 
-    vector<int> mapArray;
+    int hadamardCredit;
 
-    vector<float> crosstalk;
+    int windowTarget;
 
-public:
-    HardwareA(string hwname,bool isUniDirection);
+    int windowScan;
 
-    int GetQNum();
+    CostModel();
+};
 
-    int GetENum();
+CostModel::CostModel()
+{
+    ctScale=cof;
+    readahead=Readahead;
+    cx=1;
+    cxReversed=5;
+    bridge=4;
+    bridgeReversed=10;
+    swap=7;
+    hadamardCredit=2;
+    windowTarget=0;
+    windowScan=8;
+}
 
-    void GetArch(string hwname);
 
-    void PrintArchMatrix();
+/*
+ * How a device is built from its files. With zeroCrosstalk a missing
+ * crosstalk file means zero crosstalk everywhere instead of an error. With
+ * a cacheDir the precomputed tables are kept there as images named by the
+ * hash of the device files; without one no image is read or written. With
+ * reportErrors a device that cannot be built is left empty with the reason
+ * in GetError instead of ending the process.
+ */
+struct DeviceOptions
+{
+    bool zeroCrosstalk;
 
-    void GetCrosstalk(string ctname);
+    bool reportErrors;
 
-    void Floyd();
+    string cacheDir;
 
-    void VerifyRouteMatrix();
+    DeviceOptions();
+};
 
-    void PrintRouteMatrix();
+DeviceOptions::DeviceOptions()
+{
+    zeroCrosstalk=false;
+    reportErrors=false;
+}
 
-    void PrintPath(int i,int j);
 
-    void PrintMap();
+uint64_t Fnv1a(uint64_t hash,const void* data,size_t size);
 
-    void InitMap(vector<vector<int>> seq);
 
-    float Alloc(vector<vector<int>> seq);
+struct DeviceImageHeader
+{
+    char magic[4];
+
+    uint32_t version;
+
+    uint64_t key;
+
+    int32_t qubitNum;
+
+    int32_t edgeNum;
+
+    int32_t hasCrosstalk;
 
+    int32_t reserved;
 };
 
 
-HardwareA::HardwareA(string hwname,bool isUniDirection=true)
+/*
+ * Hop distances and next hops of a device as 16-bit entries, row i of each
+ * at i*qubitNum of one contiguous block. Dense tables are filled by Floyd.
+ * In lazy mode only capacity rows are held: a missing row is built by BFS
+ * over the coupling lists and replaces one not used recently (clock sweep),
+ * so the memory follows the qubits a circuit touches. A row pointer stays
+ * valid across the lookup of one other row, not longer. Coupling lists are
+ * kept sorted by rank, which BFS and the two-hop patch follow on ties.
+ */
+class RouteStore
 {
-    this->isUniDirection=isUniDirection;
+protected:
+    int qubitNum;
 
-    GetArch(hwname);
+    int capacity;
 
-    PrintArchMatrix();
+    vector<uint16_t> dist;
 
-    GetCrosstalk(hwname+"_ct");
+    vector<int16_t> route;
 
-    Floyd();
+    vector<vector<int>> outList,inList,nbrList;
 
-    cout << "Physical qubits number: " << qubitNum << endl;
-    cout << "Edge number: " << edgeNum << endl;
-}
+    vector<int> rank,slotOf,rowOf,queue;
 
+    vector<char> recent;
 
-void HardwareA::GetArch(string hwname)
-{
-    int adjIndex,i;
+    int newest,hand,used;
 
-    ifstream is(hwname,ios::in);
-    if(!is)
+    int Load(int r);
+
+    int Slot(int r)
     {
-        cout << "Cannot Open Hardware File." << endl;
-        exit(1);
-    }
+        int s=slotOf[r];
 
-    qubitNum=0;
-    edgeNum=0;
+        if(s<0)
+            s=Load(r);
+        recent[s]=1;
+        newest=s;
 
-    while(!is.eof())
-    {
-        is>>adjIndex;
-        if(adjIndex == -1)
-            qubitNum++;
+        return s;
     }
-    qubitNum--;
 
-    for(i=0; i<qubitNum; i++)
+public:
+    RouteStore();
+
+    void Reset(int qubitNum);
+
+    void SetCapacity(int rows);
+
+    void SetRank(const vector<int>& rank);
+
+    void SetEdge(int i,int j,bool enable);
+
+    bool IsLazy()
     {
-        archMatrix.push_back(vector<bool>(qubitNum,false));
-        distMatrix.push_back(vector<int>(qubitNum));
-        routeMatrix.push_back(vector<int>(qubitNum));
-        outdeg.push_back(0);
+        return capacity>0;
     }
 
-    mapArray.resize(qubitNum);
+    bool BuildRow(int r,uint16_t* d,int16_t* p);
 
-    i=0;
-    is.clear();
-    is.seekg(0,ios::beg);
+    bool Connected();
+
+    void Invalidate();
+
+    uint64_t Hash(uint64_t hash);
 
-    while(i<qubitNum && !is.eof())
+    size_t Bytes();
+
+    uint16_t* Dist(int i)
     {
-        is>>adjIndex;
-        if(adjIndex==-1)
-        {
-            archMatrix[i][i]=true;
-            i++;
-        }
+        if(capacity)
+            i=Slot(i);
+        return &dist[(size_t)i*qubitNum];
+    }
 
-        else
-        {
-            archMatrix[i][adjIndex]=true;
-            outdeg[i]++;
-            edgeNum++;
-        }
+    int16_t* Route(int i)
+    {
+        if(capacity)
+            i=Slot(i);
+        return &route[(size_t)i*qubitNum];
     }
+};
 
-    is.close();
+RouteStore::RouteStore():qubitNum(0),capacity(0),newest(-1),hand(0),used(0) {}
+
+void RouteStore::Reset(int qubitNum)
+{
+    this->qubitNum=qubitNum;
+    outList.assign(qubitNum,vector<int>());
+    inList.assign(qubitNum,vector<int>());
+    nbrList.assign(qubitNum,vector<int>());
+    rank.resize(qubitNum);
+    for(int i=0; i<qubitNum; i++)
+        rank[i]=i;
+    SetCapacity(qubitNum>LazyRoutes?RouteRows:0);
 }
 
+/*
+ * rows=0, or as many rows as the device has, selects dense tables, which
+ * the caller fills with Floyd; anything smaller selects lazy rows.
+ */
+void RouteStore::SetCapacity(int rows)
+{
+    capacity=(rows>0 && rows<qubitNum)?max(rows,8):0;
+    rows=capacity?capacity:qubitNum;
 
-void HardwareA::PrintArchMatrix()
+    dist.assign((size_t)rows*qubitNum,farDist);
+    route.assign((size_t)rows*qubitNum,-1);
+    Invalidate();
+}
+
+void RouteStore::Invalidate()
 {
-    cout << "Architecture Matrix:" << endl;
-    for(int i=0; i<qubitNum; i++)
-        for(int j=0; j<qubitNum; j++)
-        {
-            cout << archMatrix[i][j] << " ";
-            if(j==qubitNum-1)
-                cout << endl;
-        }
+    slotOf.assign(qubitNum,-1);
+    rowOf.assign(capacity,-1);
+    recent.assign(capacity,0);
+    newest=-1;
+    hand=0;
+    used=0;
 }
 
+/*
+ * Must be set before any edge; Reset restores the identity ranking.
+ */
+void RouteStore::SetRank(const vector<int>& rank)
+{
+    this->rank=rank;
+}
 
-void HardwareA::GetCrosstalk(string ctname)
+void RouteStore::SetEdge(int i,int j,bool enable)
 {
-    float ct;
-    ifstream is(ctname,ios::in);
+    vector<int>::iterator it;
 
-    if(!is)
+    auto before=[this](int a,int b)
     {
-        cout << "Cannot Open Crosstalk File." << endl;
-        exit(1);
+        return rank[a]<rank[b];
+    };
+
+    if(i==j)
+        return;
+
+    it=lower_bound(outList[i].begin(),outList[i].end(),j,before);
+    if(enable && (it==outList[i].end() || *it!=j))
+    {
+        outList[i].insert(it,j);
+        inList[j].insert(lower_bound(inList[j].begin(),inList[j].end(),i,before),i);
+    }
+    else if(!enable && it!=outList[i].end() && *it==j)
+    {
+        outList[i].erase(it);
+        inList[j].erase(lower_bound(inList[j].begin(),inList[j].end(),i,before));
     }
 
-    for(int i=0; i<qubitNum; i++)
+    for(int k: {i,j})
     {
-        is >> ct;
-        crosstalk.push_back(cof*ct);
+        nbrList[k].clear();
+        set_union(outList[k].begin(),outList[k].end(),inList[k].begin(),inList[k].end(),back_inserter(nbrList[k]),before);
     }
+}
 
-    is.close();
+/*
+ * The slot handed out last is skipped, so the row before this one stays in
+ * place while the caller still holds it.
+ */
+int RouteStore::Load(int r)
+{
+    int s;
 
-    cout << "Crosstalk:" << endl;
-    for(int j=0; j<qubitNum; j++)
-        cout << crosstalk[j] << " ";
-    cout << endl;
+    if(used<capacity)
+        s=used++;
+
+    else
+    {
+        while(recent[hand] || hand==newest)
+        {
+            recent[hand]=0;
+            hand=(hand+1)%capacity;
+        }
+
+        s=hand;
+        hand=(hand+1)%capacity;
+        slotOf[rowOf[s]]=-1;
+    }
+
+    BuildRow(r,&dist[(size_t)s*qubitNum],&route[(size_t)s*qubitNum]);
+    slotOf[r]=s;
+    rowOf[s]=r;
+
+    return s;
 }
 
-void HardwareA::Floyd()
+/*
+ * BFS over the undirected coupling graph, then the two-hop patch of Floyd
+ * restricted to row r, replayed in the order Floyd writes it. Returns false
+ * when some qubit cannot be reached from r.
+ */
+bool RouteStore::BuildRow(int r,uint16_t* d,int16_t* p)
 {
-    int i,j,k;
-    for(i=0; i<qubitNum; i++)
-        for(j=0; j<qubitNum; j++)
-        {
-            if(!archMatrix[i][j] && !archMatrix[j][i])
-            {
-                distMatrix[i][j]=infinity;
-                routeMatrix[i][j]=-1;
-            }
+    unsigned int head,tail,k;
+    int x,y;
 
-            else
-            {
-                distMatrix[i][j]=1;
-                routeMatrix[i][j]=j;
-            }
-        }
+    queue.resize(qubitNum);
 
-    for(k=0; k<qubitNum; k++)
-        for(i=0; i<qubitNum; i++)
-            for(j=0; j<qubitNum; j++)
-                if(distMatrix[i][j]>distMatrix[i][k]+distMatrix[k][j])
-                {
-                    distMatrix[i][j]=distMatrix[i][k]+distMatrix[k][j];
-                    routeMatrix[i][j]=routeMatrix[i][k];
-                }
+    fill(d,d+qubitNum,(uint16_t)farDist);
+    fill(p,p+qubitNum,(int16_t)-1);
+    d[r]=1;
+    p[r]=r;
 
-    for(i=0; i<qubitNum; i++)
-        for(j=0; j<qubitNum; j++)
+    queue[0]=r;
+    for(head=0,tail=1; head<tail; head++)
+    {
+        x=queue[head];
+        for(k=0; k<nbrList[x].size(); k++)
         {
-            if(archMatrix[i][j] && i!=j)
-                for(k=0; k<qubitNum; k++)
-                {
-                    if(archMatrix[j][k] && j!=k)
-                    {
-                        routeMatrix[i][k]=j;
-                        routeMatrix[k][i]=j;
-                    }
-                }
+            y=nbrList[x][k];
+            if(y!=r && p[y]==-1)
+            {
+                d[y]=(x==r)?1:d[x]+1;
+                p[y]=(x==r)?y:p[x];
+                queue[tail++]=y;
+            }
         }
+    }
 
-    VerifyRouteMatrix();
+    if((int)head<qubitNum)
+        return false;
 
-    PrintRouteMatrix();
-}
+    for(int j: inList[r])
+        for(int i: inList[j])
+            if(rank[i]<rank[r])
+                p[i]=j;
+
+    for(int j: outList[r])
+        for(int i: outList[j])
+            p[i]=j;
 
+    for(int j: inList[r])
+        for(int i: inList[j])
+            if(rank[i]>rank[r])
+                p[i]=j;
 
+    return true;
+}
 
-void HardwareA::VerifyRouteMatrix()
+bool RouteStore::Connected()
 {
-    for(int i=0; i<qubitNum; i++)
-        for(int j=0; j<qubitNum; j++)
-            if(routeMatrix[i][j]==-1)
+    unsigned int head,tail;
+    vector<bool> seen(qubitNum,false);
+
+    queue.resize(qubitNum);
+    if(qubitNum==0)
+        return true;
+
+    queue[0]=0;
+    seen[0]=true;
+    for(head=0,tail=1; head<tail; head++)
+        for(int y: nbrList[queue[head]])
+            if(!seen[y])
             {
-                cout << "Not fully connected architecture." << endl;
-                exit(1);
+                seen[y]=true;
+                queue[tail++]=y;
             }
-}
 
-
-void HardwareA::PrintRouteMatrix()
-{
-    cout << "Route Matrix:" << endl;
-    for(int i=0; i<qubitNum; i++)
-        for(int j=0; j<qubitNum; j++)
-        {
-            cout << routeMatrix[i][j] << " ";
-            if(j==qubitNum-1)
-                cout << endl;
-        }
+    return (int)head==qubitNum;
 }
 
-
-void HardwareA::PrintPath(int i,int j)
+uint64_t RouteStore::Hash(uint64_t hash)
 {
-    int next=routeMatrix[i][j];
-    if(next==-1)
-        cout << "No Path between " << i << " and "<< j << endl;
-    else
+    int lazy=capacity>0;
+
+    hash=Fnv1a(hash,&lazy,sizeof(lazy));
+    for(int i=0; i<qubitNum; i++)
     {
-        cout << "Path from " << i << " to " << j << ": " << i << " ";
-        while(next!=j)
-        {
-            cout << next << " ";
-            next=routeMatrix[next][j];
-        }
-        cout << j << endl;
+        int deg=outList[i].size();
+        hash=Fnv1a(hash,&deg,sizeof(deg));
+        hash=Fnv1a(hash,outList[i].data(),deg*sizeof(int));
     }
+
+    return hash;
 }
 
-int HardwareA::GetQNum()
+size_t RouteStore::Bytes()
 {
-    return qubitNum;
+    return dist.size()*sizeof(uint16_t)+route.size()*sizeof(int16_t);
 }
 
 
-int HardwareA::GetENum()
+class HardwareA
 {
-    return edgeNum;
-}
+protected:
+    int qubitNum;
 
+    int edgeNum;
 
-void HardwareA::InitMap(vector<vector<int>> seq)
-{
-    int i;
-    unsigned int j;
-    vector<int> freq(qubitNum,0);
-    vector<int> sortFreq(1,0);
-    vector<int> sortOutDeg(1,0);
+    bool isUniDirection;
 
-    for(j=0; j<seq.size(); j++)
-        if(seq[j][0]>=0)
-            freq[seq[j][0]]++;
+    vector<vector<bool>> archMatrix;
 
-    for(i=1; i<qubitNum; i++)
-        for(j=0; j<sortFreq.size(); j++)
-        {
-            if(freq[i]>freq[sortFreq[j]])
-            {
-                sortFreq.insert(sortFreq.begin()+j,i);
-                break;
-            }
+    vector<vector<bool>> fileMatrix;
 
-            if(j==sortFreq.size()-1)
-            {
-                sortFreq.push_back(i);
-                break;
-            }
-        }
+    RouteStore routes;
 
-    for(i=1; i<qubitNum; i++)
-        for(j=0; j<sortOutDeg.size(); j++)
-        {
-            if(outdeg[i]>outdeg[sortOutDeg[j]])
-            {
-                sortOutDeg.insert(sortOutDeg.begin()+j,i);
-                break;
-            }
+    vector<int> outdeg;
 
-            if(j==sortOutDeg.size()-1)
-            {
-                sortOutDeg.push_back(i);
-                break;
-            }
-        }
+    vector<int> mapArray;
 
-    for(i=0; i<qubitNum; i++)
-        mapArray[sortOutDeg[i]]=sortFreq[i];
+    vector<float> crosstalk;
 
-}
+    vector<float> rawCrosstalk;
 
+    CostModel model;
 
-void HardwareA::PrintMap()
-{
-    int i;
-    cout << "Physical qubits: ";
-    for(i=0; i<qubitNum; i++)
-        cout << i << " ";
-    cout << endl;
-    cout << "Pseudo   qubits: ";
-    for(i=0; i<qubitNum; i++)
-        cout << mapArray[i] << " ";
-    cout << endl;
-}
+    DeviceOptions deviceOptions;
 
-float HardwareA::Alloc(vector<vector<int>> seq)
-{
-    unsigned int i;
-    int j,temp,current,next,dest;
-    float cost=0;
+    string loadError;
 
-    for(i=0; i<seq.size(); i++)
-    {
-        if(seq[i][0]<0)
-            for(j=0; j<qubitNum; j++)
-            {
-                if(mapArray[j]==seq[i][1])
-                {
-                    cost=cost+crosstalk[j];
-                    break;
-                }
-            }
+    vector<vector<int>> automorphisms;
 
-        else
-        {
-            for(j=0; j<qubitNum; j++)
-            {
-                if(mapArray[j]==seq[i][1])
-                    current=j;
+    vector<int> extOf,intOf;
 
-                if(mapArray[j]==seq[i][0])
-                    dest=j;
-            }
+    bool Fail(string message);
 
-            next=routeMatrix[current][dest];
+    bool RepairRows(const vector<int>& rows);
 
-            while(next!=dest)
+    void FindAutomorphisms();
+
+    virtual void OnTopologyChange() {}
+
+    uint64_t DeviceKey(string hwname,bool& hasCrosstalk);
+
+    bool LoadDeviceImage(string cachename,uint64_t key);
+
+    bool SaveDeviceImage(string cachename,uint64_t key,bool hasCrosstalk);
+
+    bool LocalityOrder(vector<int>& order);
+
+    void Renumber(const vector<int>& order);
+
+    void FileLayout(const vector<int>& layout,vector<int>& out);
+
+public:
+    HardwareA(string hwname,bool isUniDirection,bool verbose,const DeviceOptions& options);
+
+    virtual ~HardwareA() {}
+
+    int GetQNum();
+
+    int GetENum();
+
+    const string& GetError();
+
+    bool GetArch(string hwname);
+
+    void PrintArchMatrix();
+
+    bool GetCrosstalk(string ctname);
+
+    void PrintCrosstalk();
+
+    bool Floyd();
+
+    bool VerifyRouteMatrix();
+
+    void SetRouteCache(int rows);
+
+    bool UpdateCrosstalk(const vector<float>& ct);
+
+    void SetCostModel(const CostModel& model);
+
+    const CostModel& GetCostModel();
+
+    bool SetCoupler(int i,int j,bool enable);
+
+    int GetSymmetryNum();
+
+    int CanonicalLayout(vector<int>& layout,vector<bool>& hadamard);
+
+    void PrintRouteMatrix();
+
+    void PrintPath(int i,int j);
+
+    void PrintMap();
+
+    void InitMap(vector<vector<int>> seq);
+
+    float Alloc(vector<vector<int>> seq);
+
+};
+
+
+HardwareA::HardwareA(string hwname,bool isUniDirection=true,bool verbose=false,const DeviceOptions& options=DeviceOptions())
+{
+    uint64_t key=0;
+    bool hasCrosstalk;
+    char imagename[32];
+    string cachename;
+
+    this->isUniDirection=isUniDirection;
+    this->deviceOptions=options;
+    qubitNum=0;
+    edgeNum=0;
+
+    if(deviceOptions.cacheDir.size())
+        key=DeviceKey(hwname,hasCrosstalk);
+
+    if(key)
+    {
+        snprintf(imagename,sizeof(imagename),"%016llx.qaxcache",(unsigned long long)key);
+        cachename=deviceOptions.cacheDir+"/"+imagename;
+    }
+
+    if(key && LoadDeviceImage(cachename,key))
+    {
+        if(!hasCrosstalk && !deviceOptions.zeroCrosstalk)
+            Fail("Cannot Open Crosstalk File.");
+
+        else if(!hasCrosstalk)
+            cout << "Cannot Open Crosstalk File " << hwname+"_ct" << ", assuming zero crosstalk." << endl;
+    }
+
+    else if(GetArch(hwname) && GetCrosstalk(hwname+"_ct") && Floyd())
+    {
+        if(key && !routes.IsLazy() && !SaveDeviceImage(cachename,key,hasCrosstalk) && verbose)
+            cout << "Cannot write device image " << cachename << "." << endl;
+    }
+
+    if(loadError.size())
+    {
+        qubitNum=0;
+        edgeNum=0;
+        archMatrix.clear();
+        outdeg.clear();
+        mapArray.clear();
+        crosstalk.clear();
+        rawCrosstalk.clear();
+        extOf.clear();
+        intOf.clear();
+        routes.Reset(0);
+        return;
+    }
+
+    if(qubitNum>RenumberQubits)
+    {
+        vector<int> order;
+
+        if(LocalityOrder(order))
+            Renumber(order);
+    }
+
+    fileMatrix=archMatrix;
+
+    FindAutomorphisms();
+
+    if(verbose)
+    {
+        PrintArchMatrix();
+        PrintCrosstalk();
+        PrintRouteMatrix();
+
+        cout << "Physical qubits number: " << qubitNum << '\n';
+        cout << "Edge number: " << edgeNum << '\n';
+        cout << "Automorphisms: " << automorphisms.size() << endl;
+    }
+}
+
+
+bool HardwareA::GetArch(string hwname)
+{
+    int adjIndex,i;
+    unsigned int j;
+    vector<vector<int>> adjList(1);
+
+    ifstream is(hwname,ios::in);
+    if(!is)
+        return Fail("Cannot Open Hardware File.");
+
+    while(is>>adjIndex)
+    {
+        if(adjIndex==-1)
+            adjList.push_back(vector<int>());
+        else
+            adjList.back().push_back(adjIndex);
+    }
+
+    if(!is.eof())
+        return Fail("Hardware File is malformed.");
+
+    is.close();
+
+    qubitNum=adjList.size()-1;
+    edgeNum=0;
+
+    if(qubitNum==0)
+        return Fail("Hardware File has no qubits.");
+
+    if(qubitNum>INT16_MAX)
+        return Fail("Hardware File has more than "+to_string(INT16_MAX)+" qubits.");
+
+    for(i=0; i<qubitNum; i++)
+        for(j=0; j<adjList[i].size(); j++)
+            if(adjList[i][j]<0 || adjList[i][j]>=qubitNum)
+                return Fail("Hardware File names qubit "+to_string(adjList[i][j])+" of "+to_string(qubitNum)+".");
+
+    routes.Reset(qubitNum);
+
+    for(i=0; i<qubitNum; i++)
+    {
+        archMatrix.push_back(vector<bool>(qubitNum,false));
+        outdeg.push_back(0);
+        extOf.push_back(i);
+    }
+    intOf=extOf;
+
+    mapArray.resize(qubitNum);
+
+    for(i=0; i<qubitNum; i++)
+    {
+        archMatrix[i][i]=true;
+
+        for(j=0; j<adjList[i].size(); j++)
+        {
+            archMatrix[i][adjList[i][j]]=true;
+            routes.SetEdge(i,adjList[i][j],true);
+            outdeg[i]++;
+            edgeNum++;
+        }
+    }
+
+    return true;
+}
+
+
+/*
+ * Key of the cached device image: a hash of the arch file and of the
+ * crosstalk file, or of its absence. Returns 0 when the arch file cannot be
+ * read, which leaves reporting the error to GetArch.
+ */
+uint64_t HardwareA::DeviceKey(string hwname,bool& hasCrosstalk)
+{
+    uint64_t key=0xcbf29ce484222325ULL;
+    string names[2]={hwname,hwname+"_ct"};
+    char buffer[4096];
+
+    hasCrosstalk=false;
+
+    for(int f=0; f<2; f++)
+    {
+        ifstream is(names[f],ios::in|ios::binary);
+
+        if(!is)
+        {
+            if(f==0)
+                return 0;
+            key=Fnv1a(key,"-",1);
+            continue;
+        }
+
+        while(is.read(buffer,sizeof(buffer)) || is.gcount())
+            key=Fnv1a(key,buffer,is.gcount());
+
+        key=Fnv1a(key,&f,sizeof(f));
+        hasCrosstalk=(f==1);
+    }
+
+    return key?key:1;
+}
+
+
+/*
+ * Device image layout after the header: the distance and next hop rows as
+ * 16-bit entries, outdeg, the raw crosstalk, then archMatrix as bytes, so
+ * every section stays aligned. Anything that does not match the key or the
+ * expected size is ignored and rebuilt.
+ */
+bool HardwareA::LoadDeviceImage(string cachename,uint64_t key)
+{
+    int fd,i,j,n;
+    struct stat st;
+    const DeviceImageHeader* header;
+    const unsigned char* base;
+    const unsigned char* arch;
+    const uint16_t* dist;
+    const int16_t* route;
+    const int32_t* deg;
+    const float* ct;
+    void* image;
+
+    fd=open(cachename.c_str(),O_RDONLY);
+    if(fd<0)
+        return false;
+
+    if(fstat(fd,&st)!=0 || st.st_size<(off_t)sizeof(DeviceImageHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    image=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if(image==MAP_FAILED)
+        return false;
+
+    base=(const unsigned char*)image;
+    header=(const DeviceImageHeader*)base;
+    n=header->qubitNum;
+
+    if(memcmp(header->magic,"QAXD",4)!=0 || header->version!=2 || header->key!=key || n<=0 || n>LazyRoutes
+       || st.st_size!=(off_t)(sizeof(DeviceImageHeader)+4*(size_t)n*n+sizeof(int32_t)*n+sizeof(float)*n+(size_t)n*n))
+    {
+        munmap(image,st.st_size);
+        return false;
+    }
+
+    dist=(const uint16_t*)(base+sizeof(DeviceImageHeader));
+    route=(const int16_t*)(dist+(size_t)n*n);
+    deg=(const int32_t*)(route+(size_t)n*n);
+    ct=(const float*)(deg+n);
+    arch=(const unsigned char*)(ct+n);
+
+    qubitNum=n;
+    edgeNum=header->edgeNum;
+
+    archMatrix.assign(n,vector<bool>(n));
+    routes.Reset(n);
+
+    extOf.resize(n);
+    for(i=0; i<n; i++)
+        extOf[i]=i;
+    intOf=extOf;
+
+    for(i=0; i<n; i++)
+    {
+        for(j=0; j<n; j++)
+        {
+            archMatrix[i][j]=arch[i*n+j];
+            if(arch[i*n+j])
+                routes.SetEdge(i,j,true);
+        }
+        memcpy(routes.Dist(i),dist+(size_t)i*n,n*sizeof(uint16_t));
+        memcpy(routes.Route(i),route+(size_t)i*n,n*sizeof(int16_t));
+    }
+
+    outdeg.assign(deg,deg+n);
+    rawCrosstalk.assign(ct,ct+n);
+    crosstalk.clear();
+    for(i=0; i<n; i++)
+        crosstalk.push_back(model.ctScale*rawCrosstalk[i]);
+
+    mapArray.resize(n);
+
+    munmap(image,st.st_size);
+
+    return true;
+}
+
+
+/*
+ * Written to a private temporary name and renamed into place, so processes
+ * starting together never see a half-written image. Failing to write the
+ * image only costs the next process a rebuild.
+ */
+bool HardwareA::SaveDeviceImage(string cachename,uint64_t key,bool hasCrosstalk)
+{
+    DeviceImageHeader header;
+    vector<unsigned char> arch;
+    string tmpname=cachename+".tmp"+to_string(getpid());
+    int i;
+
+    memset(&header,0,sizeof(header));
+    memcpy(header.magic,"QAXD",4);
+    header.version=2;
+    header.key=key;
+    header.qubitNum=qubitNum;
+    header.edgeNum=edgeNum;
+    header.hasCrosstalk=hasCrosstalk;
+
+    vector<int32_t> deg(outdeg.begin(),outdeg.end());
+
+    for(i=0; i<qubitNum; i++)
+        arch.insert(arch.end(),archMatrix[i].begin(),archMatrix[i].end());
+
+    ofstream os(tmpname,ios::out|ios::binary);
+
+    os.write((const char*)&header,sizeof(header));
+    for(i=0; i<qubitNum; i++)
+        os.write((const char*)routes.Dist(i),qubitNum*sizeof(uint16_t));
+    for(i=0; i<qubitNum; i++)
+        os.write((const char*)routes.Route(i),qubitNum*sizeof(int16_t));
+    os.write((const char*)deg.data(),qubitNum*sizeof(int32_t));
+    os.write((const char*)rawCrosstalk.data(),qubitNum*sizeof(float));
+    os.write((const char*)arch.data(),arch.size());
+    os.close();
+
+    if(!os || rename(tmpname.c_str(),cachename.c_str())!=0)
+    {
+        remove(tmpname.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+
+/*
+ * Reverse Cuthill-McKee order of the undirected coupling graph: BFS from a
+ * qubit of least degree, visiting neighbours by increasing degree, then
+ * reversed. Coupled qubits get close indices, so the rows and per-qubit
+ * entries a route walks through share cache lines and pages. Returns false
+ * when the file order already has no wider bandwidth.
+ */
+bool HardwareA::LocalityOrder(vector<int>& order)
+{
+    int i,j,start,fileWidth=0,width=0;
+    unsigned int head,first;
+    vector<vector<int>> nbr(qubitNum);
+    vector<bool> seen(qubitNum,false);
+    vector<int> pos(qubitNum);
+
+    for(i=0; i<qubitNum; i++)
+        for(j=0; j<qubitNum; j++)
+            if(i!=j && (archMatrix[i][j] || archMatrix[j][i]))
+                nbr[i].push_back(j);
+
+    auto lighter=[&](int a,int b)
+    {
+        return nbr[a].size()<nbr[b].size();
+    };
+
+    order.clear();
+    head=0;
+
+    while((int)order.size()<qubitNum)
+    {
+        start=-1;
+        for(i=0; i<qubitNum; i++)
+            if(!seen[i] && (start<0 || lighter(i,start)))
+                start=i;
+
+        seen[start]=true;
+        order.push_back(start);
+
+        for(; head<order.size(); head++)
+        {
+            first=order.size();
+            for(int x: nbr[order[head]])
+                if(!seen[x])
+                {
+                    seen[x]=true;
+                    order.push_back(x);
+                }
+            stable_sort(order.begin()+first,order.end(),lighter);
+        }
+    }
+
+    reverse(order.begin(),order.end());
+
+    for(i=0; i<qubitNum; i++)
+        pos[order[i]]=i;
+    for(i=0; i<qubitNum; i++)
+        for(int x: nbr[i])
+        {
+            fileWidth=max(fileWidth,abs(i-x));
+            width=max(width,abs(pos[i]-pos[x]));
+        }
+
+    return width<fileWidth;
+}
+
+
+/*
+ * Relabels the physical qubits so internal qubit i is order[i] of the
+ * device file. extOf and intOf translate between the two numberings; the
+ * public entry points and the route sink speak file numbers, and loops whose
+ * ties or float sums depend on qubit order walk intOf, so routing results
+ * do not change. Dense tables are permuted, lazy rows are dropped.
+ */
+void HardwareA::Renumber(const vector<int>& order)
+{
+    int i,j,r,n=qubitNum;
+    vector<vector<bool>> arch(n,vector<bool>(n,false));
+    vector<uint16_t> dist;
+    vector<int16_t> route;
+    vector<int> deg(n);
+    vector<float> raw(n);
+    bool lazy=routes.IsLazy();
+
+    if(!lazy)
+    {
+        dist.resize((size_t)n*n);
+        route.resize((size_t)n*n);
+        for(i=0; i<n; i++)
+        {
+            memcpy(&dist[(size_t)i*n],routes.Dist(i),n*sizeof(uint16_t));
+            memcpy(&route[(size_t)i*n],routes.Route(i),n*sizeof(int16_t));
+        }
+    }
+
+    extOf=order;
+    for(i=0; i<n; i++)
+        intOf[order[i]]=i;
+
+    for(i=0; i<n; i++)
+    {
+        for(j=0; j<n; j++)
+            arch[i][j]=archMatrix[order[i]][order[j]];
+        deg[i]=outdeg[order[i]];
+        raw[i]=rawCrosstalk[order[i]];
+    }
+
+    archMatrix.swap(arch);
+    outdeg.swap(deg);
+    rawCrosstalk.swap(raw);
+    for(i=0; i<n; i++)
+        crosstalk[i]=model.ctScale*rawCrosstalk[i];
+
+    routes.Reset(n);
+    routes.SetRank(extOf);
+    for(i=0; i<n; i++)
+        for(j=0; j<n; j++)
+            if(archMatrix[i][j])
+                routes.SetEdge(i,j,true);
+
+    if(!lazy)
+        for(i=0; i<n; i++)
+            for(j=0; j<n; j++)
+            {
+                routes.Dist(i)[j]=dist[(size_t)order[i]*n+order[j]];
+                r=route[(size_t)order[i]*n+order[j]];
+                routes.Route(i)[j]=(r<0)?-1:intOf[r];
+            }
+}
+
+
+void HardwareA::FileLayout(const vector<int>& layout,vector<int>& out)
+{
+    out.resize(qubitNum);
+    for(int i=0; i<qubitNum; i++)
+        out[extOf[i]]=layout[i];
+}
+
+
+void HardwareA::PrintArchMatrix()
+{
+    cout << "Architecture Matrix:" << '\n';
+    for(int i=0; i<qubitNum; i++)
+        for(int j=0; j<qubitNum; j++)
+        {
+            cout << archMatrix[intOf[i]][intOf[j]] << " ";
+            if(j==qubitNum-1)
+                cout << '\n';
+        }
+    cout.flush();
+}
+
+
+bool HardwareA::GetCrosstalk(string ctname)
+{
+    float ct;
+    ifstream is(ctname,ios::in);
+
+    if(!is && !deviceOptions.zeroCrosstalk)
+        return Fail("Cannot Open Crosstalk File.");
+
+    if(!is)
+    {
+        cout << "Cannot Open Crosstalk File " << ctname << ", assuming zero crosstalk." << endl;
+        rawCrosstalk.assign(qubitNum,0);
+        crosstalk.assign(qubitNum,0);
+        return true;
+    }
+
+    for(int i=0; i<qubitNum; i++)
+    {
+        if(!(is >> ct))
+            return Fail("Crosstalk File has fewer than "+to_string(qubitNum)+" values.");
+        rawCrosstalk.push_back(ct);
+        crosstalk.push_back(model.ctScale*ct);
+    }
+
+    is.close();
+
+    return true;
+}
+
+
+/*
+ * Reports a device that cannot be built: ends the process unless the
+ * device options ask for the error to be kept for GetError.
+ */
+bool HardwareA::Fail(string message)
+{
+    cout << message << endl;
+
+    if(!deviceOptions.reportErrors)
+        exit(1);
+
+    loadError=message;
+
+    return false;
+}
+
+
+const string& HardwareA::GetError()
+{
+    return loadError;
+}
+
+
+void HardwareA::PrintCrosstalk()
+{
+    cout << "Crosstalk:" << '\n';
+    for(int j=0; j<qubitNum; j++)
+        cout << crosstalk[intOf[j]] << " ";
+    cout << endl;
+}
+
+/*
+ * Pivots run in file order: rows and columns are independent within one
+ * pivot, but the pivot order picks which of several shortest routes wins.
+ */
+bool HardwareA::Floyd()
+{
+    int i,j,k,ii,jj,kk;
+    uint16_t *di,*dk;
+    int16_t* ri;
+
+    if(routes.IsLazy())
+        return VerifyRouteMatrix();
+
+    for(i=0; i<qubitNum; i++)
+    {
+        di=routes.Dist(i);
+        ri=routes.Route(i);
+
+        for(j=0; j<qubitNum; j++)
+        {
+            if(!archMatrix[i][j] && !archMatrix[j][i])
+            {
+                di[j]=farDist;
+                ri[j]=-1;
+            }
+
+            else
+            {
+                di[j]=1;
+                ri[j]=j;
+            }
+        }
+    }
+
+    for(kk=0; kk<qubitNum; kk++)
+    {
+        k=intOf[kk];
+        dk=routes.Dist(k);
+
+        for(i=0; i<qubitNum; i++)
+        {
+            di=routes.Dist(i);
+            ri=routes.Route(i);
+
+            for(j=0; j<qubitNum; j++)
+                if(di[j]>di[k]+dk[j])
+                {
+                    di[j]=di[k]+dk[j];
+                    ri[j]=ri[k];
+                }
+        }
+    }
+
+    for(ii=0; ii<qubitNum; ii++)
+        for(jj=0; jj<qubitNum; jj++)
+        {
+            i=intOf[ii];
+            j=intOf[jj];
+
+            if(archMatrix[i][j] && i!=j)
+                for(kk=0; kk<qubitNum; kk++)
+                {
+                    k=intOf[kk];
+                    if(archMatrix[j][k] && j!=k)
+                    {
+                        routes.Route(i)[k]=j;
+                        routes.Route(k)[i]=j;
+                    }
+                }
+        }
+
+    return VerifyRouteMatrix();
+}
+
+
+
+bool HardwareA::VerifyRouteMatrix()
+{
+    if(routes.IsLazy())
+    {
+        if(!routes.Connected())
+            return Fail("Not fully connected architecture.");
+        return true;
+    }
+
+    for(int i=0; i<qubitNum; i++)
+        for(int j=0; j<qubitNum; j++)
+            if(routes.Route(i)[j]==-1)
+                return Fail("Not fully connected architecture.");
+
+    return true;
+}
+
+
+/*
+ * Switches between dense tables (rows=0) and lazily built rows with an LRU
+ * of the given size. Lazy rows follow BFS order on ties, like the rows
+ * SetCoupler repairs, so routes can differ from the Floyd tables.
+ */
+void HardwareA::SetRouteCache(int rows)
+{
+    routes.SetCapacity(rows);
+
+    if(!routes.IsLazy())
+        Floyd();
+
+    OnTopologyChange();
+}
+
+
+bool HardwareA::UpdateCrosstalk(const vector<float>& ct)
+{
+    if((int)ct.size()!=qubitNum)
+        return false;
+
+    for(int i=0; i<qubitNum; i++)
+    {
+        rawCrosstalk[i]=ct[extOf[i]];
+        crosstalk[i]=model.ctScale*rawCrosstalk[i];
+    }
+
+    FindAutomorphisms();
+
+    return true;
+}
+
+
+void HardwareA::SetCostModel(const CostModel& model)
+{
+    this->model=model;
+
+    for(int i=0; i<qubitNum; i++)
+        crosstalk[i]=model.ctScale*rawCrosstalk[i];
+}
+
+
+const CostModel& HardwareA::GetCostModel()
+{
+    return model;
+}
+
+
+/*
+ * Enables or disables the coupler i->j and repairs only the rows of the
+ * route tables that can change: sources with a shortest path over {i,j}
+ * when the undirected graph changes, plus the rows written by the two-hop
+ * patch through i->j. Lazy rows are simply dropped. A change that would
+ * disconnect the device is rolled back and reported as false. Only couplers
+ * of the device file can be enabled: on other topologies the two-hop patch
+ * can leave routes that never reach their target.
+ */
+bool HardwareA::SetCoupler(int i,int j,bool enable)
+{
+    int r,x;
+    unsigned int k;
+    bool undirected,affected;
+    vector<int> rows;
+    vector<bool> inRows(qubitNum,false);
+    vector<vector<uint16_t>> oldDist;
+    vector<vector<int16_t>> oldRoute;
+
+    if(i<0 || j<0 || i>=qubitNum || j>=qubitNum || i==j)
+        return false;
+
+    i=intOf[i];
+    j=intOf[j];
+
+    if(archMatrix[i][j]==enable)
+        return true;
+
+    if(enable && !fileMatrix[i][j])
+        return false;
+
+    if(routes.IsLazy())
+    {
+        archMatrix[i][j]=enable;
+        routes.SetEdge(i,j,enable);
+
+        if(!routes.Connected())
+        {
+            archMatrix[i][j]=!enable;
+            routes.SetEdge(i,j,!enable);
+            return false;
+        }
+
+        outdeg[i]=outdeg[i]+(enable?1:-1);
+        edgeNum=edgeNum+(enable?1:-1);
+        routes.Invalidate();
+        FindAutomorphisms();
+        OnTopologyChange();
+
+        return true;
+    }
+
+    undirected=!archMatrix[j][i];
+
+    auto dist=[this](int a,int b)
+    {
+        return a==b?0:(int)routes.Dist(a)[b];
+    };
+
+    if(undirected)
+        for(r=0; r<qubitNum; r++)
+        {
+            affected=false;
+            for(x=0; x<qubitNum && !affected; x++)
+            {
+                if(enable)
+                    affected=dist(r,i)+1+dist(j,x)<dist(r,x) || dist(r,j)+1+dist(i,x)<dist(r,x);
+                else
+                    affected=dist(r,i)+1+dist(j,x)==dist(r,x) || dist(r,j)+1+dist(i,x)==dist(r,x);
+            }
+            if(affected)
+                inRows[r]=true;
+        }
+
+    inRows[i]=true;
+    inRows[j]=true;
+    for(x=0; x<qubitNum; x++)
+        if((archMatrix[j][x] && x!=j) || (archMatrix[x][i] && x!=i))
+            inRows[x]=true;
+
+    for(r=0; r<qubitNum; r++)
+        if(inRows[r])
+        {
+            rows.push_back(r);
+            oldDist.push_back(vector<uint16_t>(routes.Dist(r),routes.Dist(r)+qubitNum));
+            oldRoute.push_back(vector<int16_t>(routes.Route(r),routes.Route(r)+qubitNum));
+        }
+
+    archMatrix[i][j]=enable;
+    routes.SetEdge(i,j,enable);
+    outdeg[i]=outdeg[i]+(enable?1:-1);
+    edgeNum=edgeNum+(enable?1:-1);
+
+    if(!RepairRows(rows))
+    {
+        archMatrix[i][j]=!enable;
+        routes.SetEdge(i,j,!enable);
+        outdeg[i]=outdeg[i]+(enable?-1:1);
+        edgeNum=edgeNum+(enable?-1:1);
+
+        for(k=0; k<rows.size(); k++)
+        {
+            copy(oldDist[k].begin(),oldDist[k].end(),routes.Dist(rows[k]));
+            copy(oldRoute[k].begin(),oldRoute[k].end(),routes.Route(rows[k]));
+            for(x=0; x<qubitNum; x++)
+                routes.Dist(x)[rows[k]]=oldDist[k][x];
+        }
+
+        return false;
+    }
+
+    FindAutomorphisms();
+    OnTopologyChange();
+
+    return true;
+}
+
+
+bool HardwareA::RepairRows(const vector<int>& rows)
+{
+    int r,x;
+
+    for(unsigned int k=0; k<rows.size(); k++)
+    {
+        r=rows[k];
+
+        if(!routes.BuildRow(r,routes.Dist(r),routes.Route(r)))
+            return false;
+
+        for(x=0; x<qubitNum; x++)
+            routes.Dist(x)[r]=routes.Dist(r)[x];
+    }
+
+    return true;
+}
+
+
+/*
+ * Permutations of the physical qubits that preserve the directed coupling
+ * graph and the crosstalk, found by backtracking in BFS order: every qubit
+ * after the first has a placed neighbour, so its image is one of that
+ * neighbour's image's neighbours. Each is stored as its inverse (image
+ * position -> original position), identity first. The search stops after
+ * SymmetryLimit of them; any subset still gives sound canonical forms.
+ */
+void HardwareA::FindAutomorphisms()
+{
+    int i,j,k,v,w,u,placed,mapped;
+    long steps=0,stepLimit=1000L*qubitNum;
+    vector<vector<int>> nbr(qubitNum);
+    vector<int> order,parent(qubitNum,-1),image(qubitNum,-1),inverse(qubitNum,-1),next(qubitNum,0);
+    vector<bool> seen(qubitNum,false);
+
+    automorphisms.assign(1,vector<int>(qubitNum));
+    for(i=0; i<qubitNum; i++)
+        automorphisms[0][i]=i;
+
+    for(i=0; i<qubitNum; i++)
+        for(k=0; k<qubitNum; k++)
+        {
+            j=intOf[k];
+            if(i!=j && (archMatrix[i][j] || archMatrix[j][i]))
+                nbr[i].push_back(j);
+        }
+
+    auto same=[&](int a,int b)
+    {
+        return outdeg[a]==outdeg[b] && nbr[a].size()==nbr[b].size() && rawCrosstalk[a]==rawCrosstalk[b];
+    };
+
+    auto fits=[&](int v,int w)
+    {
+        if(inverse[w]>=0 || !same(v,w))
+            return false;
+
+        placed=0;
+        for(int x: nbr[v])
+            if(image[x]>=0)
+            {
+                if(archMatrix[v][x]!=archMatrix[w][image[x]] || archMatrix[x][v]!=archMatrix[image[x]][w])
+                    return false;
+                placed++;
+            }
+
+        mapped=0;
+        for(int y: nbr[w])
+            if(inverse[y]>=0)
+                mapped++;
+
+        return placed==mapped;
+    };
+
+    if(qubitNum==0)
+        return;
+
+    order.push_back(intOf[0]);
+    seen[intOf[0]]=true;
+    for(k=0; k<(int)order.size(); k++)
+        for(int x: nbr[order[k]])
+            if(!seen[x])
+            {
+                seen[x]=true;
+                parent[x]=order[k];
+                order.push_back(x);
+            }
+
+    if((int)order.size()<qubitNum)
+        return;
+
+    k=0;
+    while(k>=0)
+    {
+        v=order[k];
+
+        if(image[v]>=0)
+        {
+            inverse[image[v]]=-1;
+            image[v]=-1;
+        }
+
+        w=-1;
+        if(k==0)
+        {
+            while(next[k]<qubitNum && w<0 && steps++<stepLimit)
+            {
+                if(fits(v,intOf[next[k]]))
+                    w=intOf[next[k]];
+                next[k]++;
+            }
+        }
+        else
+        {
+            u=image[parent[v]];
+            while(next[k]<(int)nbr[u].size() && w<0 && steps++<stepLimit)
+            {
+                if(fits(v,nbr[u][next[k]]))
+                    w=nbr[u][next[k]];
+                next[k]++;
+            }
+        }
+
+        if(w<0)
+        {
+            if(steps>=stepLimit)
+                break;
+            next[k]=0;
+            k--;
+            continue;
+        }
+
+        image[v]=w;
+        inverse[w]=v;
+
+        if(k<qubitNum-1)
+        {
+            k++;
+            continue;
+        }
+
+        if(inverse!=automorphisms[0])
+            automorphisms.push_back(inverse);
+        if((int)automorphisms.size()>=SymmetryLimit)
+            break;
+    }
+}
+
+
+int HardwareA::GetSymmetryNum()
+{
+    return automorphisms.size();
+}
+
+
+/*
+ * Relabels layout (physical -> logical) and the per-qubit hadamard flags
+ * by the automorphism that makes the layout, then the flags, smallest when
+ * read in file order.
+ * Layouts related by a symmetry of the device get the same canonical form,
+ * and routing costs from either are the same. Returns the index used.
+ */
+int HardwareA::CanonicalLayout(vector<int>& layout,vector<bool>& hadamard)
+{
+    unsigned int a,best=0;
+    int q,x,d;
+    vector<int> relabeled(qubitNum);
+    vector<bool> flags(qubitNum);
+
+    for(a=1; a<automorphisms.size(); a++)
+    {
+        const vector<int>& cur=automorphisms[a];
+        const vector<int>& top=automorphisms[best];
+
+        d=0;
+        for(x=0; x<qubitNum && d==0; x++)
+        {
+            q=intOf[x];
+            d=layout[cur[q]]-layout[top[q]];
+        }
+        for(x=0; x<qubitNum && d==0; x++)
+        {
+            q=intOf[x];
+            d=(int)hadamard[cur[q]]-(int)hadamard[top[q]];
+        }
+
+        if(d<0)
+            best=a;
+    }
+
+    if(best==0)
+        return 0;
+
+    for(q=0; q<qubitNum; q++)
+    {
+        relabeled[q]=layout[automorphisms[best][q]];
+        flags[q]=hadamard[automorphisms[best][q]];
+    }
+
+    layout.swap(relabeled);
+    hadamard.swap(flags);
+
+    return best;
+}
+
+
+void HardwareA::PrintRouteMatrix()
+{
+    int next;
+
+    cout << "Route Matrix:" << '\n';
+    for(int i=0; i<qubitNum; i++)
+        for(int j=0; j<qubitNum; j++)
+        {
+            next=routes.Route(intOf[i])[intOf[j]];
+            cout << (next<0?-1:extOf[next]) << " ";
+            if(j==qubitNum-1)
+                cout << '\n';
+        }
+    cout.flush();
+}
+
+
+void HardwareA::PrintPath(int i,int j)
+{
+    int next=routes.Route(intOf[i])[intOf[j]];
+    if(next==-1)
+        cout << "No Path between " << i << " and "<< j << endl;
+    else
+    {
+        cout << "Path from " << i << " to " << j << ": " << i << " ";
+        while(next!=intOf[j])
+        {
+            cout << extOf[next] << " ";
+            next=routes.Route(next)[intOf[j]];
+        }
+        cout << j << endl;
+    }
+}
+
+int HardwareA::GetQNum()
+{
+    return qubitNum;
+}
+
+
+int HardwareA::GetENum()
+{
+    return edgeNum;
+}
+
+
+void HardwareA::InitMap(vector<vector<int>> seq)
+{
+    int i;
+    unsigned int j;
+    vector<int> freq(qubitNum,0);
+    vector<int> sortFreq(1,0);
+    vector<int> sortOutDeg(1,intOf[0]);
+
+    for(j=0; j<seq.size(); j++)
+        if(seq[j][0]>=0)
+            freq[seq[j][0]]++;
+
+    for(i=1; i<qubitNum; i++)
+        for(j=0; j<sortFreq.size(); j++)
+        {
+            if(freq[i]>freq[sortFreq[j]])
+            {
+                sortFreq.insert(sortFreq.begin()+j,i);
+                break;
+            }
+
+            if(j==sortFreq.size()-1)
+            {
+                sortFreq.push_back(i);
+                break;
+            }
+        }
+
+    for(i=1; i<qubitNum; i++)
+        for(j=0; j<sortOutDeg.size(); j++)
+        {
+            if(outdeg[intOf[i]]>outdeg[sortOutDeg[j]])
+            {
+                sortOutDeg.insert(sortOutDeg.begin()+j,intOf[i]);
+                break;
+            }
+
+            if(j==sortOutDeg.size()-1)
+            {
+                sortOutDeg.push_back(intOf[i]);
+                break;
+            }
+        }
+
+    for(i=0; i<qubitNum; i++)
+        mapArray[sortOutDeg[i]]=sortFreq[i];
+
+}
+
+
+void HardwareA::PrintMap()
+{
+    int i;
+    cout << "Physical qubits: ";
+    for(i=0; i<qubitNum; i++)
+        cout << i << " ";
+    cout << endl;
+    cout << "Pseudo   qubits: ";
+    for(i=0; i<qubitNum; i++)
+        cout << mapArray[intOf[i]] << " ";
+    cout << endl;
+}
+
+float HardwareA::Alloc(vector<vector<int>> seq)
+{
+    unsigned int i;
+    int j,temp,current,next,dest;
+    float cost=0;
+
+    for(i=0; i<seq.size(); i++)
+    {
+        if(seq[i][0]<0)
+            for(j=0; j<qubitNum; j++)
+            {
+                if(mapArray[j]==seq[i][1])
+                {
+                    cost=cost+crosstalk[j];
+                    break;
+                }
+            }
+
+        else
+        {
+            for(j=0; j<qubitNum; j++)
+            {
+                if(mapArray[j]==seq[i][1])
+                    current=j;
+
+                if(mapArray[j]==seq[i][0])
+                    dest=j;
+            }
+
+            next=routes.Route(current)[dest];
+
+            while(next!=dest)
+            {
+                temp=mapArray[current];
+                mapArray[current]=mapArray[next];
+                mapArray[next]=temp;
+
+                cost=cost+model.swap;
+
+                current=next;
+                next=routes.Route(current)[dest];
+            }
+
+            if(archMatrix[current][next])
+            cost=cost+model.cx;
+            else
+                cost=cost+model.cxReversed;
+        }
+    }
+
+    return cost;
+}
+
+class HardwareB:public HardwareA
+{
+protected:
+    vector<int> sgateNum;
+
+public:
+    HardwareB(string hwname,bool isUniDirection,bool verbose,const DeviceOptions& options);
+
+    float Alloc(vector<vector<int>> seq);
+};
+
+HardwareB::HardwareB(string hwname,bool isUniDirection=true,bool verbose=false,const DeviceOptions& options=DeviceOptions()):HardwareA(hwname,isUniDirection,verbose,options)
+{
+    for(int i=0; i<qubitNum; i++)
+        sgateNum.push_back(0);
+}
+
+float HardwareB::Alloc(vector<vector<int>> seq)
+{
+    unsigned int i;
+    float minsgc,cost=0;
+    int j,temp, beg,current,next,dest;
+
+    for(i=0; i<seq.size(); i++)
+    {
+        if(seq[i][0]<0)
+            for(j=0; j<qubitNum; j++)
+            {
+                if(mapArray[j]==seq[i][1])
+                {
+                    sgateNum[j]++;
+                    break;
+                }
+            }
+
+        else
+        {
+            for(j=0; j<qubitNum; j++)
+            {
+                if(mapArray[j]==seq[i][1])
+                    beg=j;
+
+                if(mapArray[j]==seq[i][0])
+                    dest=j;
+            }
+
+            if(crosstalk[dest]>crosstalk[beg])
+            {
+                temp=beg;
+                beg=dest;
+                dest=temp;
+            }
+
+            cost=cost+crosstalk[dest]*sgateNum[dest];
+            sgateNum[dest]=0;
+
+            minsgc=crosstalk[beg];
+
+            next=routes.Route(beg)[dest];
+
+            current=beg;
+
+            while(next!=dest)
+            {
+                temp=mapArray[current];
+                mapArray[current]=mapArray[next];
+                mapArray[next]=temp;
+
+                cost=cost+model.swap;
+                current=next;
+                next=routes.Route(current)[dest];
+
+                if(crosstalk[current]<minsgc)
+                    minsgc=crosstalk[current];
+            }
+
+            if(archMatrix[current][next])
+                cost=cost+model.cx;
+            else
+                cost=cost+model.cxReversed;
+
+            cost=cost+minsgc*sgateNum[beg];
+            sgateNum[beg]=0;
+        }
+    }
+
+    for(i=0; i<(unsigned int)qubitNum; i++)
+    {
+        j=intOf[i];
+        if(sgateNum[j]!=0)
+        {
+            cost=cost+crosstalk[j]*sgateNum[j];
+            sgateNum[j]=0;
+        }
+    }
+
+    return cost;
+}
+
+
+class CostAccumulator
+{
+protected:
+    const vector<float>* crosstalk;
+
+    const CostModel* model;
+
+    const vector<int>* order;
+
+    float cost;
+
+public:
+    virtual ~CostAccumulator() {}
+
+    virtual void Reset(const vector<float>& crosstalk,const CostModel& model,const vector<int>& order);
+
+    virtual void Single(int phys)=0;
+
+    virtual void GateBegin(int beg,int dest) {}
+
+    virtual void Swap(int current,int next)=0;
+
+    virtual void GateEnd(int current,int next,bool forward)=0;
+
+    virtual void Finish() {}
+
+    float GetCost();
+};
+
+void CostAccumulator::Reset(const vector<float>& crosstalk,const CostModel& model,const vector<int>& order)
+{
+    this->crosstalk=&crosstalk;
+    this->model=&model;
+    this->order=&order;
+    cost=0;
+}
+
+float CostAccumulator::GetCost()
+{
+    return cost;
+}
+
+
+class UniformCost:public CostAccumulator
+{
+public:
+    void Single(int phys);
+
+    void Swap(int current,int next);
+
+    void GateEnd(int current,int next,bool forward);
+};
+
+void UniformCost::Single(int phys)
+{
+    cost=cost+(*crosstalk)[phys];
+}
+
+void UniformCost::Swap(int current,int next)
+{
+    cost=cost+model->swap;
+}
+
+void UniformCost::GateEnd(int current,int next,bool forward)
+{
+    if(forward)
+        cost=cost+model->cx;
+    else
+        cost=cost+model->cxReversed;
+}
+
+
+class CrosstalkCost:public CostAccumulator
+{
+protected:
+    vector<int> sgateNum;
+
+    float minsgc;
+
+    int beg;
+
+public:
+    void Reset(const vector<float>& crosstalk,const CostModel& model,const vector<int>& order);
+
+    void Single(int phys);
+
+    void GateBegin(int beg,int dest);
+
+    void Swap(int current,int next);
+
+    void GateEnd(int current,int next,bool forward);
+
+    void Finish();
+};
+
+void CrosstalkCost::Reset(const vector<float>& crosstalk,const CostModel& model,const vector<int>& order)
+{
+    CostAccumulator::Reset(crosstalk,model,order);
+    sgateNum.assign(crosstalk.size(),0);
+}
+
+void CrosstalkCost::Single(int phys)
+{
+    sgateNum[phys]++;
+}
+
+void CrosstalkCost::GateBegin(int beg,int dest)
+{
+    cost=cost+(*crosstalk)[dest]*sgateNum[dest];
+    sgateNum[dest]=0;
+
+    minsgc=(*crosstalk)[beg];
+    this->beg=beg;
+}
+
+void CrosstalkCost::Swap(int current,int next)
+{
+    cost=cost+model->swap;
+
+    if((*crosstalk)[next]<minsgc)
+        minsgc=(*crosstalk)[next];
+}
+
+void CrosstalkCost::GateEnd(int current,int next,bool forward)
+{
+    if(forward)
+        cost=cost+model->cx;
+    else
+        cost=cost+model->cxReversed;
+
+    cost=cost+minsgc*sgateNum[beg];
+    sgateNum[beg]=0;
+}
+
+void CrosstalkCost::Finish()
+{
+    for(int j: *order)
+        if(sgateNum[j]!=0)
+        {
+            cost=cost+(*crosstalk)[j]*sgateNum[j];
+            sgateNum[j]=0;
+        }
+}
+
+
+/*
+ * Routes the sequence once and reports every routing event to all
+ * accumulators, so K cost models cost a single pass. With orientByCrosstalk
+ * the route starts from the noisier endpoint as HardwareB does, otherwise
+ * it follows HardwareA.
+ */
+class HardwareFused:public HardwareA
+{
+protected:
+    bool orientByCrosstalk;
+
+public:
+    HardwareFused(string hwname,bool orientByCrosstalk,bool isUniDirection,bool verbose,const DeviceOptions& options);
+
+    void Alloc(vector<vector<int>> seq,vector<CostAccumulator*>& accumulators);
+};
+
+HardwareFused::HardwareFused(string hwname,bool orientByCrosstalk=false,bool isUniDirection=true,bool verbose=false,const DeviceOptions& options=DeviceOptions()):HardwareA(hwname,isUniDirection,verbose,options)
+{
+    this->orientByCrosstalk=orientByCrosstalk;
+}
+
+void HardwareFused::Alloc(vector<vector<int>> seq,vector<CostAccumulator*>& accumulators)
+{
+    unsigned int i,k;
+    int j,temp,current,next,dest;
+    unsigned int accNum=accumulators.size();
+
+    for(k=0; k<accNum; k++)
+        accumulators[k]->Reset(crosstalk,model,intOf);
+
+    for(i=0; i<seq.size(); i++)
+    {
+        if(seq[i][0]<0)
+            for(j=0; j<qubitNum; j++)
+            {
+                if(mapArray[j]==seq[i][1])
+                {
+                    for(k=0; k<accNum; k++)
+                        accumulators[k]->Single(j);
+                    break;
+                }
+            }
+
+        else
+        {
+            for(j=0; j<qubitNum; j++)
+            {
+                if(mapArray[j]==seq[i][1])
+                    current=j;
+
+                if(mapArray[j]==seq[i][0])
+                    dest=j;
+            }
+
+            if(orientByCrosstalk && crosstalk[dest]>crosstalk[current])
+            {
+                temp=current;
+                current=dest;
+                dest=temp;
+            }
+
+            for(k=0; k<accNum; k++)
+                accumulators[k]->GateBegin(current,dest);
+
+            next=routes.Route(current)[dest];
+
+            while(next!=dest)
+            {
+                temp=mapArray[current];
+                mapArray[current]=mapArray[next];
+                mapArray[next]=temp;
+
+                for(k=0; k<accNum; k++)
+                    accumulators[k]->Swap(current,next);
+
+                current=next;
+                next=routes.Route(current)[dest];
+            }
+
+            for(k=0; k<accNum; k++)
+                accumulators[k]->GateEnd(current,next,archMatrix[current][next]);
+        }
+    }
+
+    for(k=0; k<accNum; k++)
+        accumulators[k]->Finish();
+}
+
+
+int frac(int n);
+
+typedef array<int,3> Gate;
+
+typedef vector<Gate> PackedSeq;
+
+void PackSeq(PackedSeq &packed,const vector<vector<int>> &seq);
+
+int Peephole(PackedSeq &seq);
+
+
+struct UniformPolicy
+{
+    typedef int CostType;
+
+    static const int id=0;
+
+    static void Single(vector<int>& sgateNum,int j,const vector<float>& crosstalk,float& totalcost,int count)
+    {
+        totalcost=totalcost+crosstalk[j]*count;
+    }
+
+    static void HadamardCancel(int j,const vector<float>& crosstalk,float& totalcost)
+    {
+        totalcost--;
+    }
+
+    template<class Counts>
+    static void GateBegin(Counts& sgateNum,int beg,int dest,const vector<float>& crosstalk,CostType& cost,float& minsgc) {}
+
+    static void Hop(int current,const vector<float>& crosstalk,float& minsgc) {}
+
+    template<class Counts>
+    static void GateEnd(Counts& sgateNum,int beg,CostType& cost,float minsgc) {}
+
+    static void Finish(vector<int>& sgateNum,const vector<float>& crosstalk,float& totalcost,const vector<int>& order) {}
+};
+
+
+struct CrosstalkPolicy
+{
+    typedef float CostType;
+
+    static const int id=1;
+
+    static void Single(vector<int>& sgateNum,int j,const vector<float>& crosstalk,float& totalcost,int count)
+    {
+        sgateNum[j]=sgateNum[j]+count;
+    }
+
+    static void HadamardCancel(int j,const vector<float>& crosstalk,float& totalcost)
+    {
+        totalcost=totalcost-crosstalk[j];
+    }
+
+    template<class Counts>
+    static void GateBegin(Counts& sgateNum,int beg,int dest,const vector<float>& crosstalk,CostType& cost,float& minsgc)
+    {
+        cost=cost+crosstalk[dest]*sgateNum[dest];
+        sgateNum[dest]=0;
+
+        minsgc=crosstalk[beg];
+    }
+
+    static void Hop(int current,const vector<float>& crosstalk,float& minsgc)
+    {
+        if(crosstalk[current]<minsgc)
+            minsgc=crosstalk[current];
+    }
+
+    template<class Counts>
+    static void GateEnd(Counts& sgateNum,int beg,CostType& cost,float minsgc)
+    {
+        cost=cost+minsgc*sgateNum[beg];
+        sgateNum[beg]=0;
+    }
+
+    static void Finish(vector<int>& sgateNum,const vector<float>& crosstalk,float& totalcost,const vector<int>& order)
+    {
+        for(int j: order)
+            if(sgateNum[j]!=0)
+            {
+                totalcost=totalcost+crosstalk[j]*sgateNum[j];
+                sgateNum[j]=0;
+            }
+    }
+};
+
+
+struct ArenaMark
+{
+    unsigned int block;
+
+    size_t offset;
+};
+
+
+/*
+ * Bump allocator for transient engine state. Blocks are kept across resets,
+ * so once a run has warmed up, allocation is a pointer bump and releasing a
+ * window or a whole circuit is rewinding to a mark. Copies start empty.
+ */
+class Arena
+{
+protected:
+    vector<vector<char>> blocks;
+
+    unsigned int block;
+
+    size_t offset;
+
+    size_t blockSize;
+
+    void* Grow(size_t size);
+
+public:
+    Arena(size_t blockSize);
+
+    Arena(const Arena& other);
+
+    Arena& operator=(const Arena& other);
+
+    void* Allocate(size_t size,size_t align)
+    {
+        offset=(offset+align-1)&~(align-1);
+
+        if(block<blocks.size() && offset+size<=blocks[block].size())
+        {
+            offset=offset+size;
+            return &blocks[block][offset-size];
+        }
+
+        return Grow(size);
+    }
+
+    ArenaMark Mark();
+
+    void Rewind(ArenaMark mark);
+};
+
+Arena::Arena(size_t blockSize=1<<16):block(0),offset(0),blockSize(blockSize) {}
+
+Arena::Arena(const Arena& other):block(0),offset(0),blockSize(other.blockSize) {}
+
+Arena& Arena::operator=(const Arena& other)
+{
+    block=0;
+    offset=0;
+    blockSize=other.blockSize;
+
+    return *this;
+}
+
+void* Arena::Grow(size_t size)
+{
+    if(block<blocks.size())
+        block++;
+
+    while(block<blocks.size() && blocks[block].size()<size)
+        block++;
+
+    if(block==blocks.size())
+        blocks.push_back(vector<char>(max(blockSize,size)));
+
+    offset=size;
+
+    return blocks[block].data();
+}
+
+ArenaMark Arena::Mark()
+{
+    ArenaMark mark={block,offset};
+
+    return mark;
+}
+
+void Arena::Rewind(ArenaMark mark)
+{
+    block=mark.block;
+    offset=mark.offset;
+}
+
+
+class ArenaScope
+{
+protected:
+    Arena& arena;
+
+    ArenaMark mark;
+
+public:
+    ArenaScope(Arena& arena):arena(arena),mark(arena.Mark()) {}
+
+    ~ArenaScope()
+    {
+        arena.Rewind(mark);
+    }
+};
+
+
+template<class T>
+struct ArenaAllocator
+{
+    typedef T value_type;
+
+    Arena* arena;
+
+    ArenaAllocator(Arena* arena):arena(arena) {}
+
+    template<class U>
+    ArenaAllocator(const ArenaAllocator<U>& other):arena(other.arena) {}
+
+    T* allocate(size_t n)
+    {
+        return (T*)arena->Allocate(n*sizeof(T),alignof(T));
+    }
+
+    void deallocate(T* p,size_t n) {}
+};
+
+template<class T,class U>
+bool operator==(const ArenaAllocator<T>& a,const ArenaAllocator<U>& b)
+{
+    return a.arena==b.arena;
+}
+
+template<class T,class U>
+bool operator!=(const ArenaAllocator<T>& a,const ArenaAllocator<U>& b)
+{
+    return a.arena!=b.arena;
+}
+
+template<class T>
+using ArenaVector=vector<T,ArenaAllocator<T>>;
+
+
+struct AllocBudget
+{
+    double seconds;
+
+    long work;
+};
+
+
+/*
+ * Admission test for gates joining a window. The classic front takes a gate
+ * only while its qubits are untouched by the window. The commuting front
+ * keeps control and target masks instead: CX gates sharing a control (or a
+ * target) commute, so a window may hold several of them, and a later gate
+ * may pass a skipped one as long as the two commute. Skip records gates left
+ * for the next window; once every qubit is blocked in every role the window
+ * cannot grow. The masks limit the commuting front to 64 qubits.
+ */
+struct WindowFront
+{
+    bool commuting;
+
+    vector<bool> vacant;
+
+    uint64_t winCtrl,winTgt,pendCtrl,pendTgt,pendAny,all;
+
+    void Reset(int qubitNum,bool commuting);
+
+    void Clear();
+
+    bool Single(int q)
+    {
+        if(!commuting)
+            return vacant[q];
+
+        return !((winCtrl|winTgt|pendCtrl|pendTgt|pendAny)>>q&1);
+    }
+
+    bool CX(int c,int t)
+    {
+        if(!commuting)
+        {
+            if(!vacant[c] || !vacant[t])
+                return false;
+
+            vacant[c]=false;
+            vacant[t]=false;
+            return true;
+        }
+
+        if((winTgt|pendTgt|pendAny)>>c&1 || (winCtrl|pendCtrl|pendAny)>>t&1)
+            return false;
+
+        winCtrl|=1ULL<<c;
+        winTgt|=1ULL<<t;
+        return true;
+    }
+
+    void Skip(int c,int t)
+    {
+        if(!commuting)
+            return;
+
+        if(c<0)
+            pendAny|=1ULL<<t;
+        else
+        {
+            pendCtrl|=1ULL<<c;
+            pendTgt|=1ULL<<t;
+        }
+    }
+
+    bool Saturated()
+    {
+        return commuting && (pendAny|(pendCtrl&pendTgt))==all;
+    }
+};
+
+void WindowFront::Reset(int qubitNum,bool commuting)
+{
+    this->commuting=commuting;
+    vacant.assign(qubitNum,true);
+    all=(qubitNum>=64)?~0ULL:(1ULL<<qubitNum)-1;
+    Clear();
+}
+
+void WindowFront::Clear()
+{
+    fill(vacant.begin(),vacant.end(),true);
+    winCtrl=0;
+    winTgt=0;
+    pendCtrl=0;
+    pendTgt=0;
+    pendAny=0;
+}
+
+
+struct AllocReport
+{
+    long windows;
+
+    long cappedWindows;
+
+    long subAllocs;
+
+    int minReadahead;
+
+    long minPermCap;
+
+    double seconds;
+
+    bool exhausted;
+};
+
+
+/*
+ * Engine state after a window that closed before the end, so it does not
+ * depend on anything past the last entry read so far (scanned), which can
+ * lie beyond the window when the end of the circuit was routed first.
+ * prefixHash covers the device, the cost model, the policy and entries
+ * [0,scanned]; entries before next and those listed in doneAfter are routed.
+ */
+struct AllocCheckpoint
+{
+    int next;
+
+    int scanned;
+
+    uint64_t prefixHash;
+
+    float totalcost;
+
+    vector<int> mapArray;
+
+    vector<bool> hadamard;
+
+    vector<int> sgateNum;
+
+    vector<int> doneAfter;
+};
+
+
+/*
+ * A routed circuit kept for cost queries: the state after every window,
+ * entry 0 being the initial layout, the first gate on each logical qubit
+ * and the final cost. routed counts the windows the last query re-routed.
+ */
+struct RouteDelta
+{
+    PackedSeq seq;
+
+    vector<AllocCheckpoint> checkpoints;
+
+    vector<int> firstGate;
+
+    float totalcost;
+
+    int routed;
+};
+
+
+/*
+ * Resumes routing from start, the state after window, and stops once the
+ * state after a window equals the reference state after the same window.
+ */
+struct AllocTrial
+{
+    const AllocCheckpoint* start;
+
+    int window;
+
+    const vector<AllocCheckpoint>* reference;
+
+    int converged;
+
+    int routed;
+};
+
+bool SaveCheckpoints(const vector<AllocCheckpoint>& checkpoints,string fname);
+
+bool LoadCheckpoints(vector<AllocCheckpoint>& checkpoints,string fname);
+
+
+enum RouteOp {OpLayout,OpSingle,OpH,OpCX,OpSwap};
+
+struct RoutedGate
+{
+    int op;
+
+    int q[3];
+};
+
+
+/*
+ * Receives the physical circuit the window engine settles on. Records sit in
+ * a preallocated power-of-two ring: without a file the ring keeps the newest
+ * gates, with one it is written out whenever it fills, so emission never
+ * allocates. Hadamards that reverse a CX are held pending per qubit and only
+ * emitted once no later reversal or logical H can cancel them. A bridge is
+ * written as the four CX gates it stands for, reversed ones included.
+ */
+class RouteSink
+{
+protected:
+    vector<RoutedGate> ring;
+
+    unsigned long long mask;
+
+    unsigned long long head;
+
+    unsigned long long written;
+
+    FILE* file;
+
+    vector<bool> pendingH;
+
+    void Drain();
+
+public:
+    RouteSink(int logCapacity,string fname);
+
+    ~RouteSink();
+
+    void Emit(int op,int a,int b,int c)
+    {
+        RoutedGate& g=ring[head&mask];
+
+        g.op=op;
+        g.q[0]=a;
+        g.q[1]=b;
+        g.q[2]=c;
+
+        if(++head-written>mask && file)
+            Drain();
+    }
+
+    void Begin(const vector<int>& mapArray);
+
+    void End(const vector<int>& mapArray);
+
+    void Flush(int q);
+
+    void Single(int q,int count);
+
+    void Hadamard(int q);
+
+    void CX(int c,int t,bool native);
+
+    void Swap(int a,int b);
+
+    void Bridge(int c,int m,int t,bool nativeFirst,bool nativeSecond);
+
+    unsigned long long Emitted();
+
+    int Retained();
+
+    const RoutedGate& operator[](int i);
+};
+
+RouteSink::RouteSink(int logCapacity,string fname=""):ring(1ULL<<logCapacity),mask((1ULL<<logCapacity)-1),head(0),written(0),file(NULL)
+{
+    if(fname.size())
+    {
+        file=fopen(fname.c_str(),"wb");
+        if(!file)
+        {
+            cout << "Cannot open trace file " << fname << "." << endl;
+            exit(1);
+        }
+        fwrite("QAXR\1\0\0\0",1,8,file);
+    }
+}
+
+RouteSink::~RouteSink()
+{
+    if(file)
+    {
+        Drain();
+        fclose(file);
+    }
+}
+
+void RouteSink::Drain()
+{
+    unsigned long long from=written&mask,n=head-written;
+
+    if(from+n>ring.size())
+    {
+        fwrite(&ring[from],sizeof(RoutedGate),ring.size()-from,file);
+        fwrite(&ring[0],sizeof(RoutedGate),from+n-ring.size(),file);
+    }
+    else
+        fwrite(&ring[from],sizeof(RoutedGate),n,file);
+
+    written=head;
+}
+
+void RouteSink::Begin(const vector<int>& mapArray)
+{
+    pendingH.assign(mapArray.size(),false);
+
+    for(unsigned int i=0; i<mapArray.size(); i++)
+        Emit(OpLayout,i,mapArray[i],0);
+}
+
+void RouteSink::End(const vector<int>& mapArray)
+{
+    for(unsigned int i=0; i<mapArray.size(); i++)
+        Flush(i);
+
+    for(unsigned int i=0; i<mapArray.size(); i++)
+        Emit(OpLayout,i,mapArray[i],1);
+
+    if(file)
+    {
+        Drain();
+        fflush(file);
+    }
+}
+
+void RouteSink::Flush(int q)
+{
+    if(pendingH[q])
+    {
+        Emit(OpH,q,-1,-1);
+        pendingH[q]=false;
+    }
+}
+
+void RouteSink::Single(int q,int count)
+{
+    Flush(q);
+    Emit(OpSingle,q,count,-1);
+}
+
+void RouteSink::Hadamard(int q)
+{
+    pendingH[q]=!pendingH[q];
+}
+
+void RouteSink::CX(int c,int t,bool native)
+{
+    if(native)
+    {
+        Flush(c);
+        Flush(t);
+        Emit(OpCX,c,t,-1);
+    }
+
+    else
+    {
+        if(!pendingH[c])
+            Emit(OpH,c,-1,-1);
+        if(!pendingH[t])
+            Emit(OpH,t,-1,-1);
+
+        Emit(OpCX,t,c,-1);
+
+        pendingH[c]=true;
+        pendingH[t]=true;
+    }
+}
+
+void RouteSink::Swap(int a,int b)
+{
+    Flush(a);
+    Flush(b);
+    Emit(OpSwap,a,b,-1);
+}
+
+/*
+ * CX c->t over m: CX(c,m) CX(m,t) CX(c,m) CX(m,t), where nativeFirst and
+ * nativeSecond say whether c->m and m->t exist as couplers.
+ */
+void RouteSink::Bridge(int c,int m,int t,bool nativeFirst,bool nativeSecond)
+{
+    CX(c,m,nativeFirst);
+    CX(m,t,nativeSecond);
+    CX(c,m,nativeFirst);
+    CX(m,t,nativeSecond);
+}
+
+unsigned long long RouteSink::Emitted()
+{
+    return head;
+}
+
+int RouteSink::Retained()
+{
+    return (int)min(head,mask+1);
+}
+
+const RoutedGate& RouteSink::operator[](int i)
+{
+    return ring[(head-Retained()+i)&mask];
+}
+
+
+template<class Policy>
+struct WindowBest
+{
+    typename Policy::CostType mincost;
+
+    vector<int> minmap;
+
+    vector<bool> minhadamard;
+
+    vector<int> minsgateNum;
+
+    PackedSeq minorder;
+};
+
+
+class HardwareC:public HardwareA
+{
+protected:
+    vector<int> placeOrder;
+
+    bool fixedOrder;
+
+    RouteSink* sink;
+
+    Arena arena;
+
+    void EmitWindow(const PackedSeq& order,const vector<int>& initMap);
+
+    template<class Policy>
+    float WindowAlloc(const PackedSeq& seq,vector<int>& sgateNum,const AllocBudget* budget,AllocReport* report,vector<AllocCheckpoint>* checkpoints=NULL,int stride=1,AllocTrial* trial=NULL);
+
+    template<class Policy>
+    float DeltaAlloc(const PackedSeq& seq,vector<int>& sgateNum,RouteDelta& delta);
+
+    template<class Policy>
+    float DeltaSwap(RouteDelta& delta,int a,int b,bool accept);
+
+    uint64_t CheckpointSeed(int policy,const vector<int>& layout,const vector<int>& sgateNum);
+
+    void OnTopologyChange();
+
+    int FindCheckpoint(const PackedSeq& seq,uint64_t seed,vector<AllocCheckpoint>& checkpoints);
+
+    template<class Policy>
+    long SearchWindow(PackedSeq& worklist,vector<bool>& hadamard,vector<int>& sgateNum,WindowBest<Policy>& best,long permCap);
+
+    template<class Policy>
+    void SubAlloc(const PackedSeq& worklist,const vector<int>& initMap,const vector<bool>& initHadamard,const vector<int>& initSgateNum,WindowBest<Policy>& best);
+
+public:
+    HardwareC(string hwname,bool isUniDirection,bool verbose,const DeviceOptions& options);
+
+    void InitMap(vector<vector<int>> seq);
+
+    void InitMap(const PackedSeq& seq);
+
+    float Alloc(vector<vector<int>> seq);
+
+    float Alloc(const PackedSeq& seq);
+
+    float Alloc(const PackedSeq& seq,const AllocBudget& budget,AllocReport& report);
+
+    float Alloc(const PackedSeq& seq,vector<AllocCheckpoint>& checkpoints,int stride);
+
+    float Alloc(const PackedSeq& seq,RouteDelta& delta);
+
+    float SwapDelta(RouteDelta& delta,int a,int b,bool accept);
+
+    void SetSink(RouteSink* sink);
+};
+
+HardwareC::HardwareC(string hwname,bool isUniDirection=true,bool verbose=false,const DeviceOptions& options=DeviceOptions()):HardwareA(hwname,isUniDirection,verbose,options)
+{
+    unsigned int j;
+    string devname=hwname.substr(hwname.find_last_of('/')+1);
+
+    sink=NULL;
+    fixedOrder=true;
+
+    if(loadError.size())
+        return;
+
+    if(devname=="ibmqx5")
+        placeOrder={4,13,12,5,3,14,6,11,10,7,15,2,0,9,8,1};
+
+    else if(devname=="ibmqxm")
+        placeOrder={6,5,10,9,7,2,1,4,13,14,8,11,15,12,0,3};
+
+    else
+        fixedOrder=false;
+
+    if(fixedOrder)
+        for(j=0; j<placeOrder.size(); j++)
+            placeOrder[j]=intOf[placeOrder[j]];
+    else
+        OnTopologyChange();
+}
+
+/*
+ * Devices without a fixed placement order place by out-degree, so the order
+ * is rebuilt whenever SetCoupler changes a degree.
+ */
+void HardwareC::OnTopologyChange()
+{
+    int i;
+    unsigned int j;
+
+    if(fixedOrder)
+        return;
+
+    placeOrder.assign(1,0);
+
+    for(i=1; i<qubitNum; i++)
+        for(j=0; j<placeOrder.size(); j++)
+        {
+            if(outdeg[intOf[i]]>outdeg[intOf[placeOrder[j]]])
+            {
+                placeOrder.insert(placeOrder.begin()+j,i);
+                break;
+            }
+
+            if(j==placeOrder.size()-1)
+            {
+                placeOrder.push_back(i);
+                break;
+            }
+        }
+
+    for(j=0; j<placeOrder.size(); j++)
+        placeOrder[j]=intOf[placeOrder[j]];
+}
+
+void HardwareC::InitMap(vector<vector<int>> seq)
+{
+    PackedSeq packed;
+
+    PackSeq(packed,seq);
+
+    InitMap(packed);
+}
+
+void HardwareC::InitMap(const PackedSeq& seq)
+{
+    int i;
+    unsigned int j;
+    vector<int> freq(qubitNum,0);
+    vector<int> sortFreq(1,0);
+
+    for(j=0; j<seq.size(); j++)
+        if(seq[j][0]>=0)
+            freq[seq[j][1]]++;
+
+    for(i=1; i<qubitNum; i++)
+        for(j=0; j<sortFreq.size(); j++)
+        {
+            if(freq[i]>freq[sortFreq[j]])
+            {
+                sortFreq.insert(sortFreq.begin()+j,i);
+                break;
+            }
+
+            if(j==sortFreq.size()-1)
+            {
+                sortFreq.push_back(i);
+                break;
+            }
+        }
+
+    for(i=0; i<qubitNum; i++)
+        mapArray[placeOrder[i]]=sortFreq[i];
+
+}
+
+
+float HardwareC::Alloc(vector<vector<int>> seq)
+{
+    PackedSeq packed;
+
+    PackSeq(packed,seq);
+
+    return Alloc(packed);
+}
+
+float HardwareC::Alloc(const PackedSeq& seq)
+{
+    vector<int> sgateNum;
+
+    return WindowAlloc<UniformPolicy>(seq,sgateNum,NULL,NULL);
+}
+
+float HardwareC::Alloc(const PackedSeq& seq,const AllocBudget& budget,AllocReport& report)
+{
+    vector<int> sgateNum;
+
+    return WindowAlloc<UniformPolicy>(seq,sgateNum,&budget,&report);
+}
+
+/*
+ * Routes seq resuming from the latest checkpoint whose prefix seq still
+ * shares, so re-routing an extended circuit only walks the new suffix.
+ * Without a usable checkpoint routing starts from the current mapArray.
+ * Stale checkpoints are dropped and new ones are taken every stride windows.
+ */
+float HardwareC::Alloc(const PackedSeq& seq,vector<AllocCheckpoint>& checkpoints,int stride=1)
+{
+    vector<int> sgateNum;
+
+    return WindowAlloc<UniformPolicy>(seq,sgateNum,NULL,NULL,&checkpoints,stride);
+}
+
+float HardwareC::Alloc(const PackedSeq& seq,RouteDelta& delta)
+{
+    vector<int> sgateNum;
+
+    return DeltaAlloc<UniformPolicy>(seq,sgateNum,delta);
+}
+
+float HardwareC::SwapDelta(RouteDelta& delta,int a,int b,bool accept=false)
+{
+    return DeltaSwap<UniformPolicy>(delta,a,b,accept);
+}
+
+void HardwareC::SetSink(RouteSink* sink)
+{
+    this->sink=sink;
+}
+
+/*
+ * Replays the winning order of a window from the map it started with,
+ * walking the same routes SubAlloc costed, and hands the gates to the sink.
+ */
+void HardwareC::EmitWindow(const PackedSeq& order,const vector<int>& initMap)
+{
+    unsigned int i;
+    int j,beg,current,next,dest,temp;
+    ArenaScope scope(arena);
+    ArenaVector<int> mapArray(initMap.begin(),initMap.end(),ArenaAllocator<int>(&arena));
+
+    for(i=0; i<order.size(); i++)
+    {
+        for(j=0; j<qubitNum; j++)
+        {
+            if(mapArray[j]==order[i][0])
+                beg=j;
+
+            if(mapArray[j]==order[i][1])
+                dest=j;
+        }
+
+        next=routes.Route(beg)[dest];
+
+        if(next==dest)
+            sink->CX(extOf[beg],extOf[dest],archMatrix[beg][dest]);
+
+        else
+        {
+            current=beg;
+
+            while(routes.Route(next)[dest]!=dest)
+            {
+                sink->Swap(extOf[current],extOf[next]);
+
+                temp=mapArray[current];
+                mapArray[current]=mapArray[next];
+                mapArray[next]=temp;
+
+                current=next;
+                next=routes.Route(current)[dest];
+            }
+
+            sink->Bridge(extOf[current],extOf[next],extOf[dest],archMatrix[current][next],archMatrix[next][dest]);
+        }
+    }
+}
+
+/*
+ * Everything a checkpoint depends on besides the gates: device, cost model,
+ * policy and the state routing starts from.
+ */
+uint64_t HardwareC::CheckpointSeed(int policy,const vector<int>& layout,const vector<int>& sgateNum)
+{
+    uint64_t hash=0xcbf29ce484222325ULL;
+    int fields[]={policy,qubitNum,model.readahead,model.cx,model.cxReversed,model.bridge,model.bridgeReversed,model.swap,model.hadamardCredit,model.windowTarget,model.windowScan};
+
+    hash=Fnv1a(hash,fields,sizeof(fields));
+    hash=Fnv1a(hash,&model.ctScale,sizeof(model.ctScale));
+    hash=Fnv1a(hash,crosstalk.data(),crosstalk.size()*sizeof(float));
+    hash=routes.Hash(hash);
+    hash=Fnv1a(hash,layout.data(),layout.size()*sizeof(int));
+    hash=Fnv1a(hash,sgateNum.data(),sgateNum.size()*sizeof(int));
+
+    return hash;
+}
+
+/*
+ * Checkpoints are ordered by scanned, so one pass over seq checks them all:
+ * once a prefix hash differs every later one does too.
+ */
+int HardwareC::FindCheckpoint(const PackedSeq& seq,uint64_t seed,vector<AllocCheckpoint>& checkpoints)
+{
+    unsigned int k,i=0;
+    int found=-1;
+    uint64_t hash=seed;
+
+    for(k=0; k<checkpoints.size(); k++)
+    {
+        if(checkpoints[k].scanned>=(int)seq.size() || checkpoints[k].mapArray.size()!=(unsigned int)qubitNum)
+            break;
+
+        for(; (int)i<=checkpoints[k].scanned; i++)
+            hash=Fnv1a(hash,&seq[i],sizeof(Gate));
+
+        if(hash!=checkpoints[k].prefixHash)
+            break;
+
+        found=k;
+    }
+
+    checkpoints.resize(found+1);
+
+    return found;
+}
+
+/*
+ * Shared window/permutation engine of HardwareC and HardwareD. The policy
+ * decides how single-qubit gates are charged and is resolved at compile
+ * time, so the inner loops carry no dispatch.
+ *
+ * A window closes readahead gates after its first blocked gate. With a
+ * window target in the cost model it is packed through a commuting front
+ * instead and closes once it holds target CX gates, nothing more can join,
+ * or windowScan gates passed the first blocked one.
+ *
+ * With a budget the engine compares the share of the budget spent with the
+ * share of gates routed after every window. When behind it shrinks the
+ * readahead and halves the permutation cap, when well ahead it grows them
+ * back, and once the budget is gone it routes greedily to the end.
+ */
+template<class Policy>
+float HardwareC::WindowAlloc(const PackedSeq& seq,vector<int>& sgateNum,const AllocBudget* budget,AllocReport* report,vector<AllocCheckpoint>* checkpoints,int stride,AllocTrial* trial)
+{
+    int i,j;
+    int record,cnt,done=0;
+    float totalcost=0;
+    bool flag=false,closed;
+    PackedSeq worklist;
+    WindowBest<Policy> best;
+    vector<bool> hadamard(qubitNum,false);
+    ArenaScope scope(arena);
+    ArenaVector<bool> seqitem(seq.size(),true,ArenaAllocator<bool>(&arena));
+    int seqSize=seq.size();
+    int readahead=model.readahead;
+    bool packed=model.windowTarget>0 && qubitNum<=64;
+    int target=min(model.windowTarget,8);
+    WindowFront front;
+    long permCap=LONG_MAX;
+    long evaluated;
+    double used,progress;
+    chrono::steady_clock::time_point starttime;
+    int start=0,hashed=0,windows=0;
+    uint64_t hash=0;
+    vector<int> fileMap;
+    const AllocCheckpoint* resume=NULL;
+
+    if(budget)
+        checkpoints=NULL;
+
+    if(report)
+    {
+        report->windows=0;
+        report->cappedWindows=0;
+        report->subAllocs=0;
+        report->minReadahead=readahead;
+        report->minPermCap=permCap;
+        report->exhausted=false;
+        starttime=chrono::steady_clock::now();
+    }
+
+    front.Reset(qubitNum,packed);
+    record=seqSize;
+    cnt=0;
+
+    if(checkpoints)
+    {
+        hash=CheckpointSeed(Policy::id,mapArray,sgateNum);
+        j=FindCheckpoint(seq,hash,*checkpoints);
+
+        if(j>=0)
+            resume=&(*checkpoints)[j];
+    }
+
+    if(trial)
+    {
+        resume=trial->start;
+        windows=trial->window;
+        trial->converged=-1;
+    }
+
+    if(resume)
+    {
+        mapArray=resume->mapArray;
+        hadamard=resume->hadamard;
+        sgateNum=resume->sgateNum;
+        totalcost=resume->totalcost;
+        hash=resume->prefixHash;
+        hashed=resume->scanned+1;
+        start=resume->next;
+
+        fill(seqitem.begin(),seqitem.begin()+start,false);
+        for(unsigned int k=0; k<resume->doneAfter.size(); k++)
+            seqitem[resume->doneAfter[k]]=false;
+        done=start+resume->doneAfter.size();
+    }
+
+    if(sink)
+    {
+        FileLayout(mapArray,fileMap);
+        sink->Begin(fileMap);
+    }
+
+    for(i=start; i<seqSize; i++)
+    {
+        if(flag)
+            cnt++;
+
+        if(checkpoints && i==hashed)
+        {
+            hash=Fnv1a(hash,&seq[i],sizeof(Gate));
+            hashed++;
+        }
+
+        if(seq[i][0]==-1 && seqitem[i])
+        {
+            if(front.Single(seq[i][1]))
+            {
+                for(j=0; j<qubitNum; j++)
+                {
+                    if(mapArray[j]==seq[i][1])
+                        break;
+                }
+
+                Policy::Single(sgateNum,j,crosstalk,totalcost,seq[i][2]);
+
+                hadamard[j]=false;
+
+                if(sink)
+                    sink->Single(extOf[j],seq[i][2]);
+
+                seqitem[i]=false;
+                done++;
+            }
+
+            else
+            {
+                front.Skip(seq[i][0],seq[i][1]);
+                if(record>i)
+                {
+                    record=i;
+                    flag=true;
+                }
+            }
+        }
+
+        else if(seq[i][0]==-2 && seqitem[i])
+        {
+            if(front.Single(seq[i][1]))
+            {
+                for(j=0; j<qubitNum; j++)
+                {
+                    if(mapArray[j]==seq[i][1])
+                        break;
+                }
+
+                if(hadamard[j])
+                {
+                    Policy::HadamardCancel(j,crosstalk,totalcost);
+                    hadamard[j]=false;
+                }
+
+                else
+                {
+                    Policy::Single(sgateNum,j,crosstalk,totalcost,1);
+
+                    hadamard[j]=true;
+                }
+
+                if(sink)
+                    sink->Hadamard(extOf[j]);
+
+                seqitem[i]=false;
+                done++;
+            }
+
+            else
+            {
+                front.Skip(seq[i][0],seq[i][1]);
+                if(record>i)
+                {
+                    record=i;
+                    flag=true;
+                }
+            }
+        }
+
+        else if(seq[i][0]>=0 && seqitem[i])
+        {
+            if(front.CX(seq[i][0],seq[i][1]))
+            {
+                worklist.push_back(seq[i]);
+                seqitem[i]=false;
+                done++;
+            }
+
+            else
+            {
+                front.Skip(seq[i][0],seq[i][1]);
+                if(record>i)
+                {
+                    record=i;
+                    flag=true;
+                }
+            }
+        }
+
+        if(packed)
+            closed=(flag && cnt>=model.windowScan) || (int)worklist.size()>=target || front.Saturated();
+        else
+            closed=flag && cnt>=readahead;
+
+        if(closed || i==seqSize-1)
+        {
+            if(record==seqSize)
+                record=i+1;
+
+            if(worklist.size())
+            {
+                evaluated=SearchWindow<Policy>(worklist,hadamard,sgateNum,best,permCap);
+
+                if(sink)
+                    EmitWindow(best.minorder,mapArray);
+
+                mapArray.swap(best.minmap);
+                hadamard.swap(best.minhadamard);
+                sgateNum.swap(best.minsgateNum);
+                totalcost=totalcost+best.mincost;
+
+                if(report)
+                {
+                    report->windows++;
+                    report->subAllocs=report->subAllocs+evaluated;
+                    if(evaluated<frac(worklist.size()))
+                        report->cappedWindows++;
+                }
+
+                worklist.clear();
+            }
+
+            if(budget)
+            {
+                used=0;
+                if(budget->seconds>0)
+                    used=chrono::duration<double>(chrono::steady_clock::now()-starttime).count()/budget->seconds;
+                if(budget->work>0)
+                    used=max(used,(double)report->subAllocs/budget->work);
+                progress=(double)done/seqSize;
+
+                if(used>=1)
+                {
+                    report->exhausted=true;
+                    readahead=0;
+                    target=1;
+                    permCap=1;
+                }
+
+                else if(used>progress)
+                {
+                    readahead=max(0,readahead-1);
+                    target=max(1,target-1);
+                    permCap=(permCap==LONG_MAX)?64:max(1L,permCap/2);
+                }
+
+                else if(used<0.5*progress)
+                {
+                    readahead=min(model.readahead,readahead+1);
+                    target=min(min(model.windowTarget,8),target+1);
+                    permCap=(permCap>=20160)?LONG_MAX:permCap*2;
+                }
+
+                report->minReadahead=min(report->minReadahead,readahead);
+                report->minPermCap=min(report->minPermCap,permCap);
+            }
+
+            if(closed)
+                windows++;
+
+            if(checkpoints && closed && windows%stride==0)
+            {
+                AllocCheckpoint cp;
+
+                cp.next=record;
+                cp.scanned=hashed-1;
+                cp.prefixHash=hash;
+                cp.totalcost=totalcost;
+                cp.mapArray=mapArray;
+                cp.hadamard=hadamard;
+                cp.sgateNum=sgateNum;
+                for(j=record+1; j<hashed; j++)
+                    if(!seqitem[j])
+                        cp.doneAfter.push_back(j);
+
+                checkpoints->push_back(cp);
+            }
+
+            if(trial && closed && windows<(int)trial->reference->size())
+            {
+                const AllocCheckpoint& ref=(*trial->reference)[windows];
+
+                if(mapArray==ref.mapArray && hadamard==ref.hadamard && sgateNum==ref.sgateNum)
+                {
+                    trial->converged=windows;
+                    break;
+                }
+            }
+
+            front.Clear();
+
+            i=record-1;
+            record=seqSize;
+            cnt=0;
+            flag=false;
+        }
+    }
+
+    if(trial)
+    {
+        trial->routed=windows-trial->window;
+        if(trial->converged>=0)
+            return totalcost;
+    }
+
+    Policy::Finish(sgateNum,crosstalk,totalcost,intOf);
+
+    if(sink)
+    {
+        FileLayout(mapArray,fileMap);
+        sink->End(fileMap);
+    }
+
+    if(report)
+        report->seconds=chrono::duration<double>(chrono::steady_clock::now()-starttime).count();
+
+    return totalcost;
+}
+
+/*
+ * Routes seq from mapArray like Alloc and keeps the state after every
+ * window in delta for SwapDelta.
+ */
+template<class Policy>
+float HardwareC::DeltaAlloc(const PackedSeq& seq,vector<int>& sgateNum,RouteDelta& delta)
+{
+    AllocCheckpoint cp;
+    int g;
+
+    cp.next=0;
+    cp.scanned=-1;
+    cp.prefixHash=CheckpointSeed(Policy::id,mapArray,sgateNum);
+    cp.totalcost=0;
+    cp.mapArray=mapArray;
+    cp.hadamard.assign(qubitNum,false);
+    cp.sgateNum=sgateNum;
+
+    delta.seq=seq;
+    delta.checkpoints.assign(1,cp);
+    delta.firstGate.assign(qubitNum,seq.size());
+    delta.routed=0;
+
+    for(g=seq.size()-1; g>=0; g--)
+    {
+        if(seq[g][0]>=0)
+            delta.firstGate[seq[g][0]]=g;
+        delta.firstGate[seq[g][1]]=g;
+    }
+
+    delta.totalcost=WindowAlloc<Policy>(seq,sgateNum,NULL,NULL,&delta.checkpoints,1);
+    delta.routed=delta.checkpoints.size()-1;
+
+    return delta.totalcost;
+}
+
+/*
+ * Change of the cost of delta's circuit when the logical qubits initially
+ * on physical qubits a and b trade places. Until the first gate on either
+ * of them every window routes as before with the two labels exchanged, so
+ * routing resumes from the last window before that gate and stops once the
+ * layout, hadamard and single-gate state meet the cached run again; the
+ * cached cost of the rest is reused, exactly for integral costs and up to
+ * float rounding with crosstalk. With accept the swap is applied to delta.
+ */
+template<class Policy>
+float HardwareC::DeltaSwap(RouteDelta& delta,int a,int b,bool accept)
+{
+    int w,k,first,q1,q2,seqSize=delta.seq.size();
+    float cost,shift=0;
+    AllocCheckpoint start;
+    AllocTrial trial;
+    vector<int> sgateNum,finalMap=mapArray;
+    vector<AllocCheckpoint> fresh;
+    RouteSink* savedSink=sink;
+
+    auto relabel=[&](vector<int>& layout)
+    {
+        for(int& q: layout)
+            q=(q==q1)?q2:((q==q2)?q1:q);
+    };
+
+    auto rehash=[&]()
+    {
+        uint64_t hash=CheckpointSeed(Policy::id,delta.checkpoints[0].mapArray,delta.checkpoints[0].sgateNum);
+        int i=0;
+
+        for(AllocCheckpoint& cp: delta.checkpoints)
+        {
+            for(; i<=cp.scanned; i++)
+                hash=Fnv1a(hash,&delta.seq[i],sizeof(Gate));
+            cp.prefixHash=hash;
+        }
+    };
+
+    delta.routed=0;
+
+    if(delta.checkpoints.empty() || a<0 || b<0 || a>=qubitNum || b>=qubitNum || a==b)
+        return 0;
+
+    q1=delta.checkpoints[0].mapArray[intOf[a]];
+    q2=delta.checkpoints[0].mapArray[intOf[b]];
+    first=min(delta.firstGate[q1],delta.firstGate[q2]);
+
+    if(first>=seqSize)
+    {
+        if(accept)
+        {
+            for(k=0; k<(int)delta.checkpoints.size(); k++)
+                relabel(delta.checkpoints[k].mapArray);
+            relabel(mapArray);
+            rehash();
+        }
+        return 0;
+    }
+
+    auto before=[](const AllocCheckpoint& cp,int index)
+    {
+        return cp.scanned<index;
+    };
+
+    w=lower_bound(delta.checkpoints.begin(),delta.checkpoints.end(),first,before)-delta.checkpoints.begin()-1;
+
+    start=delta.checkpoints[w];
+    relabel(start.mapArray);
+
+    trial.start=&start;
+    trial.window=w;
+    trial.reference=&delta.checkpoints;
+
+    sink=NULL;
+    cost=WindowAlloc<Policy>(delta.seq,sgateNum,NULL,NULL,accept?&fresh:NULL,1,&trial);
+    sink=savedSink;
+
+    delta.routed=trial.routed;
+
+    if(trial.converged>=0)
+    {
+        shift=cost-delta.checkpoints[trial.converged].totalcost;
+        cost=delta.totalcost+shift;
+    }
+
+    if(!accept || trial.converged>=0)
+        mapArray=finalMap;
+
+    if(!accept)
+        return cost-delta.totalcost;
+
+    for(k=0; k<=w; k++)
+        relabel(delta.checkpoints[k].mapArray);
+
+    if(trial.converged>=0)
+    {
+        for(k=trial.converged+1; k<(int)delta.checkpoints.size(); k++)
+            delta.checkpoints[k].totalcost=delta.checkpoints[k].totalcost+shift;
+        delta.checkpoints.erase(delta.checkpoints.begin()+w+1,delta.checkpoints.begin()+trial.converged+1);
+    }
+    else
+        delta.checkpoints.resize(w+1);
+
+    delta.checkpoints.insert(delta.checkpoints.begin()+w+1,fresh.begin(),fresh.end());
+    rehash();
+    swap(cost,delta.totalcost);
+
+    return delta.totalcost-cost;
+}
+
+template<class Policy>
+long HardwareC::SearchWindow(PackedSeq& worklist,vector<bool>& hadamard,vector<int>& sgateNum,WindowBest<Policy>& best,long permCap)
+{
+    int n,seqLen,permuteNum;
+    long m=0;
+    Gate temp;
+
+    best.mincost=infinity;
+    seqLen=worklist.size();
+
+    if(seqLen==1)
+    {
+        SubAlloc<Policy>(worklist,mapArray,hadamard,sgateNum,best);
+        m++;
+    }
+
+    else
+    {
+        permuteNum=frac(seqLen);
+        while(m<permuteNum)
+        {
+            for(n=seqLen-1; n>0; n--)
+            {
+                if(m>=permCap)
+                    return m;
+
+                temp=worklist[n];
+                worklist[n]=worklist[n-1];
+                worklist[n-1]=temp;
+                m++;
+                SubAlloc<Policy>(worklist,mapArray,hadamard,sgateNum,best);
+            }
+
+            if(m>=permCap)
+                return m;
+
+            temp=worklist[seqLen-1];
+            worklist[seqLen-1]=worklist[seqLen-2];
+            worklist[seqLen-2]=temp;
+            m++;
+            SubAlloc<Policy>(worklist,mapArray,hadamard,sgateNum,best);
+
+            for(n=0; n<seqLen-1; n++)
+            {
+                if(m>=permCap)
+                    return m;
+
+                temp=worklist[n];
+                worklist[n]=worklist[n+1];
+                worklist[n+1]=temp;
+                m++;
+                SubAlloc<Policy>(worklist,mapArray,hadamard,sgateNum,best);
+            }
+
+            if(m>=permCap)
+                return m;
+
+            temp=worklist[0];
+            worklist[0]=worklist[1];
+            worklist[1]=temp;
+            m++;
+            SubAlloc<Policy>(worklist,mapArray,hadamard,sgateNum,best);
+        }
+    }
+
+    return m;
+}
+
+template<class Policy>
+void HardwareC::SubAlloc(const PackedSeq& worklist,const vector<int>& initMap,const vector<bool>& initHadamard,const vector<int>& initSgateNum,WindowBest<Policy>& best)
+{
+    unsigned int i;
+    int j,beg,current,next,dest,temp;
+    float minsgc;
+    typename Policy::CostType cost=0;
+    ArenaScope scope(arena);
+    ArenaVector<int> mapArray(initMap.begin(),initMap.end(),ArenaAllocator<int>(&arena));
+    ArenaVector<bool> hadamard(initHadamard.begin(),initHadamard.end(),ArenaAllocator<bool>(&arena));
+    ArenaVector<int> sgateNum(initSgateNum.begin(),initSgateNum.end(),ArenaAllocator<int>(&arena));
+
+    for(i=0; i<worklist.size(); i++)
+    {
+        for(j=0; j<qubitNum; j++)
+        {
+            if(mapArray[j]==worklist[i][0])
+                beg=j;
+
+            if(mapArray[j]==worklist[i][1])
+                dest=j;
+        }
+
+        Policy::GateBegin(sgateNum,beg,dest,crosstalk,cost,minsgc);
+
+        next=routes.Route(beg)[dest];
+
+        if(next==dest)
+        {
+            if(archMatrix[beg][next])
+            {
+                cost=cost+model.cx;
+                hadamard[beg]=false;
+                hadamard[next]=false;
+            }
+
+            else
+            {
+                cost=cost+model.cxReversed;
+
+                if(hadamard[beg])
+                    cost=cost-model.hadamardCredit;
+                else
+                    hadamard[beg]=true;
+
+                if(hadamard[next])
+                    cost=cost-model.hadamardCredit;
+                else
+                    hadamard[next]=true;
+            }
+        }
+
+        else
+        {
+            current=beg;
+
+            while(routes.Route(next)[dest]!=dest)
+            {
+                temp=mapArray[current];
+                mapArray[current]=mapArray[next];
+                mapArray[next]=temp;
+
+                cost=cost+model.swap;
+
+                hadamard[current]=false;
+                hadamard[next]=false;
+
+                current=next;
+                next=routes.Route(current)[dest];
+
+                Policy::Hop(current,crosstalk,minsgc);
+            }
+
+            if(archMatrix[current][next] && archMatrix[next][dest])
+            {
+                cost=cost+model.bridge;
+
+                hadamard[current]=false;
+                hadamard[next]=false;
+                hadamard[dest]=false;
+            }
+
+            else if(!archMatrix[current][next] && !archMatrix[next][dest])
+            {
+                cost=cost+model.bridgeReversed;
+
+                if(hadamard[current])
+                    cost=cost-model.hadamardCredit;
+                else
+                    hadamard[current]=true;
+
+                if(hadamard[next])
+                    cost=cost-model.hadamardCredit;
+                else
+                    hadamard[next]=true;
+
+                if(hadamard[dest])
+                    cost=cost-model.hadamardCredit;
+                else
+                    hadamard[dest]=true;
+            }
+
+            else if(archMatrix[current][next] && !archMatrix[next][dest])
+            {
+                cost=cost+model.bridgeReversed;
+
+                hadamard[current]=false;
+
+                if(hadamard[next])
+                {
+                    cost=cost-model.hadamardCredit;
+                    hadamard[next]=false;
+                }
+
+                if(hadamard[dest])
+                    cost=cost-model.hadamardCredit;
+                else
+                    hadamard[dest]=true;
+            }
+
+            else
+            {
+                cost=cost+model.bridgeReversed;
+
+                if(hadamard[current])
+                    cost=cost-model.hadamardCredit;
+                else
+                    hadamard[current]=true;
+
+                hadamard[next]=true;
+
+                hadamard[dest]=false;
+            }
+        }
+
+        Policy::GateEnd(sgateNum,beg,cost,minsgc);
+    }
+
+    if(cost<best.mincost)
+    {
+        best.mincost=cost;
+        best.minmap.assign(mapArray.begin(),mapArray.end());
+        best.minhadamard.assign(hadamard.begin(),hadamard.end());
+        best.minsgateNum.assign(sgateNum.begin(),sgateNum.end());
+
+        if(sink)
+            best.minorder=worklist;
+    }
+}
+
+class HardwareD:public HardwareC
+{
+protected:
+    vector<int> sgateNum;
+
+public:
+    HardwareD(string hwname,bool isUniDirection,bool verbose,const DeviceOptions& options);
+
+    float Alloc(vector<vector<int>> seq);
+
+    float Alloc(const PackedSeq& seq);
+
+    float Alloc(const PackedSeq& seq,const AllocBudget& budget,AllocReport& report);
+
+    float Alloc(const PackedSeq& seq,vector<AllocCheckpoint>& checkpoints,int stride);
+
+    float Alloc(const PackedSeq& seq,RouteDelta& delta);
+
+    float SwapDelta(RouteDelta& delta,int a,int b,bool accept);
+};
+
+HardwareD::HardwareD(string hwname,bool isUniDirection=true,bool verbose=false,const DeviceOptions& options=DeviceOptions()):HardwareC(hwname,isUniDirection,verbose,options)
+{
+    for(int i=0; i<qubitNum; i++)
+        sgateNum.push_back(0);
+}
+
+float HardwareD::Alloc(vector<vector<int>> seq)
+{
+    PackedSeq packed;
+
+    PackSeq(packed,seq);
+
+    return Alloc(packed);
+}
+
+float HardwareD::Alloc(const PackedSeq& seq)
+{
+    return WindowAlloc<CrosstalkPolicy>(seq,sgateNum,NULL,NULL);
+}
+
+float HardwareD::Alloc(const PackedSeq& seq,const AllocBudget& budget,AllocReport& report)
+{
+    return WindowAlloc<CrosstalkPolicy>(seq,sgateNum,&budget,&report);
+}
+
+float HardwareD::Alloc(const PackedSeq& seq,vector<AllocCheckpoint>& checkpoints,int stride=1)
+{
+    return WindowAlloc<CrosstalkPolicy>(seq,sgateNum,NULL,NULL,&checkpoints,stride);
+}
+
+float HardwareD::Alloc(const PackedSeq& seq,RouteDelta& delta)
+{
+    return DeltaAlloc<CrosstalkPolicy>(seq,sgateNum,delta);
+}
+
+float HardwareD::SwapDelta(RouteDelta& delta,int a,int b,bool accept=false)
+{
+    return DeltaSwap<CrosstalkPolicy>(delta,a,b,accept);
+}
+
+
+/*
+ * Greedy lookahead router. Gates are released in per-qubit order; a CX in
+ * the front layer runs as soon as its operands are within a bridge of each
+ * other, otherwise the SWAP on a coupler touching the front layer with the
+ * lowest decayed distance score over the front and the extended set is
+ * applied. Costs are charged with the HardwareD model.
+ */
+class HardwareE:public HardwareD
+{
+protected:
+    vector<vector<int>> adjList;
+
+    vector<int> place;
+
+    vector<bool> hadamard;
+
+    vector<float> minct;
+
+    float totalcost;
+
+    void SwapPhys(int a,int b);
+
+    void Charge(int phys);
+
+    void ExecGate(int beg,int dest);
+
+    float Score(const vector<int>& front,const vector<int>& extended,const PackedSeq& seq,int a,int b);
+
+    void OnTopologyChange();
+
+public:
+    HardwareE(string hwname,bool isUniDirection,bool verbose,const DeviceOptions& options);
+
+    float Alloc(vector<vector<int>> seq);
+
+    float Alloc(const PackedSeq& seq);
+};
+
+HardwareE::HardwareE(string hwname,bool isUniDirection=true,bool verbose=false,const DeviceOptions& options=DeviceOptions()):HardwareD(hwname,isUniDirection,verbose,options)
+{
+    OnTopologyChange();
+}
+
+void HardwareE::OnTopologyChange()
+{
+    int j;
+
+    HardwareC::OnTopologyChange();
+
+    adjList.assign(qubitNum,vector<int>());
+
+    for(int i=0; i<qubitNum; i++)
+        for(int k=0; k<qubitNum; k++)
+        {
+            j=intOf[k];
+            if(i!=j && (archMatrix[i][j] || archMatrix[j][i]))
+                adjList[i].push_back(j);
+        }
+}
+
+float HardwareE::Alloc(vector<vector<int>> seq)
+{
+    PackedSeq packed;
+
+    PackSeq(packed,seq);
+
+    return Alloc(packed);
+}
+
+void HardwareE::SwapPhys(int a,int b)
+{
+    int temp;
+    float ftemp;
+
+    temp=mapArray[a];
+    mapArray[a]=mapArray[b];
+    mapArray[b]=temp;
+
+    place[mapArray[a]]=a;
+    place[mapArray[b]]=b;
+
+    temp=sgateNum[a];
+    sgateNum[a]=sgateNum[b];
+    sgateNum[b]=temp;
+
+    ftemp=minct[a];
+    minct[a]=minct[b];
+    minct[b]=ftemp;
+
+    if(crosstalk[a]<minct[a])
+        minct[a]=crosstalk[a];
+    if(crosstalk[b]<minct[b])
+        minct[b]=crosstalk[b];
+
+    hadamard[a]=false;
+    hadamard[b]=false;
+
+    totalcost=totalcost+model.swap;
+}
+
+void HardwareE::Charge(int phys)
+{
+    totalcost=totalcost+minct[phys]*sgateNum[phys];
+    sgateNum[phys]=0;
+    minct[phys]=crosstalk[phys];
+}
+
+void HardwareE::ExecGate(int beg,int dest)
+{
+    int next=routes.Route(beg)[dest];
+
+    Charge(beg);
+    Charge(dest);
+
+    if(next==dest)
+    {
+        if(archMatrix[beg][dest])
+        {
+            totalcost=totalcost+model.cx;
+            hadamard[beg]=false;
+            hadamard[dest]=false;
+        }
+
+        else
+        {
+            totalcost=totalcost+model.cxReversed;
+
+            if(hadamard[beg])
+                totalcost=totalcost-model.hadamardCredit;
+            else
+                hadamard[beg]=true;
+
+            if(hadamard[dest])
+                totalcost=totalcost-model.hadamardCredit;
+            else
+                hadamard[dest]=true;
+        }
+    }
+
+    else if(archMatrix[beg][next] && archMatrix[next][dest])
+    {
+        totalcost=totalcost+model.bridge;
+
+        hadamard[beg]=false;
+        hadamard[next]=false;
+        hadamard[dest]=false;
+    }
+
+    else if(!archMatrix[beg][next] && !archMatrix[next][dest])
+    {
+        totalcost=totalcost+model.bridgeReversed;
+
+        if(hadamard[beg])
+            totalcost=totalcost-model.hadamardCredit;
+        else
+            hadamard[beg]=true;
+
+        if(hadamard[next])
+            totalcost=totalcost-model.hadamardCredit;
+        else
+            hadamard[next]=true;
+
+        if(hadamard[dest])
+            totalcost=totalcost-model.hadamardCredit;
+        else
+            hadamard[dest]=true;
+    }
+
+    else if(archMatrix[beg][next] && !archMatrix[next][dest])
+    {
+        totalcost=totalcost+model.bridgeReversed;
+
+        hadamard[beg]=false;
+
+        if(hadamard[next])
+        {
+            totalcost=totalcost-model.hadamardCredit;
+            hadamard[next]=false;
+        }
+
+        if(hadamard[dest])
+            totalcost=totalcost-model.hadamardCredit;
+        else
+            hadamard[dest]=true;
+    }
+
+    else
+    {
+        totalcost=totalcost+model.bridgeReversed;
+
+        if(hadamard[beg])
+            totalcost=totalcost-model.hadamardCredit;
+        else
+            hadamard[beg]=true;
+
+        hadamard[next]=true;
+
+        hadamard[dest]=false;
+    }
+}
+
+float HardwareE::Score(const vector<int>& front,const vector<int>& extended,const PackedSeq& seq,int a,int b)
+{
+    unsigned int i;
+    int p,q;
+    float frontScore=0,extScore=0;
+
+    for(i=0; i<front.size(); i++)
+    {
+        p=place[seq[front[i]][0]];
+        q=place[seq[front[i]][1]];
+        p=(p==a)?b:((p==b)?a:p);
+        q=(q==a)?b:((q==b)?a:q);
+        frontScore=frontScore+routes.Dist(p)[q];
+    }
+
+    for(i=0; i<extended.size(); i++)
+    {
+        p=place[seq[extended[i]][0]];
+        q=place[seq[extended[i]][1]];
+        p=(p==a)?b:((p==b)?a:p);
+        q=(q==a)?b:((q==b)?a:q);
+        extScore=extScore+routes.Dist(p)[q];
+    }
+
+    frontScore=frontScore/front.size();
+    if(extended.size())
+        frontScore=frontScore+extWeight*extScore/extended.size();
+
+    return frontScore;
+}
+
+float HardwareE::Alloc(const PackedSeq& seq)
+{
+    int i,j,k,g,q,p,beg,dest,bestA,bestB,stall;
+    unsigned int f,n;
+    float score,bestScore;
+    int seqSize=seq.size();
+    vector<int> head(qubitNum,-1);
+    vector<int> tail(qubitNum,-1);
+    vector<array<int,2>> nxt(seqSize,{-1,-1});
+    vector<float> decay(qubitNum,1);
+    vector<int> front,ready,extended;
+
+    auto release=[&](int g)
+    {
+        if(g>=0 && (seq[g][0]<0 || (head[seq[g][0]]==g && head[seq[g][1]]==g)))
+            ready.push_back(g);
+    };
+
+    place.assign(qubitNum,0);
+    hadamard.assign(qubitNum,false);
+    minct=crosstalk;
+    totalcost=0;
+
+    for(i=0; i<qubitNum; i++)
+        place[mapArray[i]]=i;
+
+    for(g=0; g<seqSize; g++)
+        for(k=seq[g][0]<0?1:0; k<2; k++)
+        {
+            q=seq[g][k];
+            if(tail[q]<0)
+                head[q]=g;
+            else
+                nxt[tail[q]][seq[tail[q]][0]==q?0:1]=g;
+            tail[q]=g;
+        }
+
+    for(q=0; q<qubitNum; q++)
+        if(head[q]>=0 && seq[head[q]][1]==q)
+            release(head[q]);
+
+    stall=0;
+
+    while(ready.size() || front.size())
+    {
+        while(ready.size())
+        {
+            g=ready.back();
+            ready.pop_back();
+
+            if(seq[g][0]>=0)
+            {
+                front.push_back(g);
+                continue;
+            }
+
+            p=place[seq[g][1]];
+
+            if(seq[g][0]==-1)
+            {
+                sgateNum[p]=sgateNum[p]+seq[g][2];
+                hadamard[p]=false;
+            }
+
+            else if(hadamard[p])
+            {
+                totalcost=totalcost-crosstalk[p];
+                hadamard[p]=false;
+            }
+
+            else
+            {
+                sgateNum[p]++;
+                hadamard[p]=true;
+            }
+
+            head[seq[g][1]]=nxt[g][1];
+            release(nxt[g][1]);
+        }
+
+        for(f=0,n=0; f<front.size(); f++)
+        {
+            g=front[f];
+            beg=place[seq[g][0]];
+            dest=place[seq[g][1]];
+
+            if(routes.Dist(beg)[dest]<=2)
+            {
+                ExecGate(beg,dest);
+
+                for(k=0; k<2; k++)
+                {
+                    head[seq[g][k]]=nxt[g][k];
+                    release(nxt[g][k]);
+                }
+            }
+
+            else
+                front[n++]=g;
+        }
+
+        if(n<front.size())
+        {
+            front.resize(n);
+            decay.assign(qubitNum,1);
+            stall=0;
+            continue;
+        }
+
+        if(front.empty())
+            continue;
+
+        if(stall>2*qubitNum)
+        {
+            g=front[0];
+            beg=place[seq[g][0]];
+            dest=place[seq[g][1]];
+
+            while(routes.Dist(beg)[dest]>2)
+            {
+                j=routes.Route(beg)[dest];
+                SwapPhys(beg,j);
+                beg=j;
+            }
+
+            stall=0;
+            continue;
+        }
+
+        extended.clear();
+        for(f=0; f<front.size() && (int)extended.size()<Extended; f++)
+            for(k=0; k<2; k++)
+            {
+                g=nxt[front[f]][k];
+                while(g>=0 && seq[g][0]<0)
+                    g=nxt[g][1];
+                if(g>=0 && (int)extended.size()<Extended)
+                    extended.push_back(g);
+            }
+
+        bestA=-1;
+        bestB=-1;
+        bestScore=infinity;
+
+        for(f=0; f<front.size(); f++)
+            for(k=0; k<2; k++)
+            {
+                p=place[seq[front[f]][k]];
+                for(n=0; n<adjList[p].size(); n++)
+                {
+                    q=adjList[p][n];
+                    score=Score(front,extended,seq,p,q)*max(decay[p],decay[q]);
+                    if(score<bestScore)
+                    {
+                        bestScore=score;
+                        bestA=p;
+                        bestB=q;
+                    }
+                }
+            }
+
+        SwapPhys(bestA,bestB);
+        decay[bestA]=decay[bestA]+decayStep;
+        decay[bestB]=decay[bestB]+decayStep;
+        stall++;
+    }
+
+    for(i=0; i<qubitNum; i++)
+        if(sgateNum[intOf[i]]!=0)
+            Charge(intOf[i]);
+
+    return totalcost;
+}
+
+
+struct ExactReport
+{
+    bool optimal;
+
+    long expanded;
+
+    long stored;
+
+    size_t memory;
+
+    double seconds;
+
+    float bound;
+};
+
+
+/*
+ * Exact A* router under the HardwareC cost model for gates executed in
+ * sequence order. A state is (layout, next gate, hadamard flags); only
+ * SWAPs on couplers touching the next CX are expanded, since any other SWAP
+ * commutes past it. The heuristic charges each remaining CX at least 1, the
+ * next one by its distance, and credits every remaining Hadamard 1, so it
+ * stays admissible under the negative Hadamard credits. Nodes are reopened
+ * when a cheaper path is found. Single gates after the last CX are charged
+ * into a goal state, and the search ends only when a goal is popped. Logical qubits the circuit never uses are
+ * interchangeable, and states are keyed by their canonical layout, so states
+ * equal up to idle qubits and a symmetry of the device are searched once;
+ * the final layout is then known up to both.
+ */
+class HardwareExact:public HardwareC
+{
+protected:
+    long nodeLimit;
+
+    size_t memLimit;
+
+    ExactReport report;
+
+    vector<int> canonical;
+
+    vector<bool> flags;
+
+    vector<bool> active;
+
+    vector<int> idle;
+
+    void Encode(string& key,const vector<int>& layout,int index,const vector<bool>& hadamard);
+
+    int Decode(const string& key,vector<int>& layout,vector<bool>& hadamard);
+
+    float DirectCost(int beg,int dest,vector<bool>& hadamard);
+
+    float BridgeCost(int current,int next,int dest,vector<bool>& hadamard);
+
+public:
+    HardwareExact(string hwname,bool isUniDirection,bool verbose,const DeviceOptions& options);
+
+    void SetLimits(long nodeLimit,size_t memLimit);
+
+    float Alloc(vector<vector<int>> seq);
+
+    float Alloc(const PackedSeq& seq);
+
+    const ExactReport& GetReport();
+};
+
+HardwareExact::HardwareExact(string hwname,bool isUniDirection=true,bool verbose=false,const DeviceOptions& options=DeviceOptions()):HardwareC(hwname,isUniDirection,verbose,options)
+{
+    nodeLimit=1000000;
+    memLimit=(size_t)512<<20;
+
+    if(qubitNum>255)
+        Fail("Exact search supports at most 255 qubits.");
+}
+
+void HardwareExact::SetLimits(long nodeLimit,size_t memLimit)
+{
+    this->nodeLimit=nodeLimit;
+    this->memLimit=memLimit;
+}
+
+const ExactReport& HardwareExact::GetReport()
+{
+    return report;
+}
+
+void HardwareExact::Encode(string& key,const vector<int>& layout,int index,const vector<bool>& hadamard)
+{
+    int i;
+
+    canonical=layout;
+    flags=hadamard;
+    for(i=0; i<qubitNum; i++)
+        if(!active[layout[i]])
+            canonical[i]=255;
+    CanonicalLayout(canonical,flags);
+
+    key.assign(qubitNum+4+(qubitNum+7)/8,0);
+
+    for(i=0; i<qubitNum; i++)
+        key[i]=(char)canonical[i];
+
+    memcpy(&key[qubitNum],&index,4);
+
+    for(i=0; i<qubitNum; i++)
+        if(flags[i])
+            key[qubitNum+4+i/8]|=(char)(1<<(i%8));
+}
+
+int HardwareExact::Decode(const string& key,vector<int>& layout,vector<bool>& hadamard)
+{
+    int i,index,n=0;
+
+    for(i=0; i<qubitNum; i++)
+        layout[i]=(unsigned char)key[i];
+    for(i=0; i<qubitNum; i++)
+        if(layout[intOf[i]]==255)
+            layout[intOf[i]]=idle[n++];
+
+    memcpy(&index,&key[qubitNum],4);
+
+    for(i=0; i<qubitNum; i++)
+        hadamard[i]=(key[qubitNum+4+i/8]>>(i%8))&1;
+
+    return index;
+}
+
+float HardwareExact::DirectCost(int beg,int dest,vector<bool>& hadamard)
+{
+    float cost=0;
+
+    if(archMatrix[beg][dest])
+    {
+        cost=cost+model.cx;
+        hadamard[beg]=false;
+        hadamard[dest]=false;
+    }
+
+    else
+    {
+        cost=cost+model.cxReversed;
+
+        if(hadamard[beg])
+            cost=cost-model.hadamardCredit;
+        else
+            hadamard[beg]=true;
+
+        if(hadamard[dest])
+            cost=cost-model.hadamardCredit;
+        else
+            hadamard[dest]=true;
+    }
+
+    return cost;
+}
+
+float HardwareExact::BridgeCost(int current,int next,int dest,vector<bool>& hadamard)
+{
+    float cost=0;
+
+    if(archMatrix[current][next] && archMatrix[next][dest])
+    {
+        cost=cost+model.bridge;
+
+        hadamard[current]=false;
+        hadamard[next]=false;
+        hadamard[dest]=false;
+    }
+
+    else if(!archMatrix[current][next] && !archMatrix[next][dest])
+    {
+        cost=cost+model.bridgeReversed;
+
+        if(hadamard[current])
+            cost=cost-model.hadamardCredit;
+        else
+            hadamard[current]=true;
+
+        if(hadamard[next])
+            cost=cost-model.hadamardCredit;
+        else
+            hadamard[next]=true;
+
+        if(hadamard[dest])
+            cost=cost-model.hadamardCredit;
+        else
+            hadamard[dest]=true;
+    }
+
+    else if(archMatrix[current][next] && !archMatrix[next][dest])
+    {
+        cost=cost+model.bridgeReversed;
+
+        hadamard[current]=false;
+
+        if(hadamard[next])
+        {
+            cost=cost-model.hadamardCredit;
+            hadamard[next]=false;
+        }
+
+        if(hadamard[dest])
+            cost=cost-model.hadamardCredit;
+        else
+            hadamard[dest]=true;
+    }
+
+    else
+    {
+        cost=cost+model.bridgeReversed;
+
+        if(hadamard[current])
+            cost=cost-model.hadamardCredit;
+        else
+            hadamard[current]=true;
+
+        hadamard[next]=true;
+
+        hadamard[dest]=false;
+    }
+
+    return cost;
+}
+
+float HardwareExact::Alloc(vector<vector<int>> seq)
+{
+    PackedSeq packed;
+
+    PackSeq(packed,seq);
+
+    return Alloc(packed);
+}
+
+float HardwareExact::Alloc(const PackedSeq& seq)
+{
+    struct Node
+    {
+        float f;
+
+        float g;
+
+        const string* key;
+
+        bool operator<(const Node& other) const
+        {
+            return f>other.f;
+        }
+    };
+
+    int i,j,k,x,index,beg,dest,dist,seqSize=seq.size();
+    float g,cost;
+    size_t keySize=qubitNum+4+(qubitNum+7)/8;
+    vector<int> cxAfter(seqSize+1,0);
+    vector<int> hAfter(seqSize+1,0);
+    vector<int> layout(qubitNum),nextLayout(qubitNum),place(qubitNum);
+    vector<bool> hadamard(qubitNum),nextHadamard(qubitNum);
+    unordered_map<string,float> best;
+    priority_queue<Node> open;
+    string key;
+    chrono::steady_clock::time_point starttime=chrono::steady_clock::now();
+    int minDirect=min(model.cx,model.cxReversed-2*model.hadamardCredit);
+    int minBridge=min(model.bridge,model.bridgeReversed-3*model.hadamardCredit);
+    int minGate=min(minDirect,minBridge);
+
+    for(i=seqSize-1; i>=0; i--)
+    {
+        cxAfter[i]=cxAfter[i+1]+(seq[i][0]>=0?1:0);
+        hAfter[i]=hAfter[i+1]+(seq[i][0]==-2?1:0);
+    }
+
+    active.assign(qubitNum,false);
+    idle.clear();
+    for(i=0; i<seqSize; i++)
+    {
+        if(seq[i][0]>=0)
+            active[seq[i][0]]=true;
+        active[seq[i][1]]=true;
+    }
+    for(i=0; i<qubitNum; i++)
+        if(!active[i])
+            idle.push_back(i);
+
+    auto heuristic=[&](const vector<int>& layout,int index)
+    {
+        int d,c=0,t=0,lb;
+
+        if(index>=seqSize)
+            return (float)0;
+
+        if(seq[index][0]<0)
+            return (float)(minGate*cxAfter[index]-hAfter[index]);
+
+        for(d=0; d<qubitNum; d++)
+        {
+            if(layout[d]==seq[index][0])
+                c=d;
+            if(layout[d]==seq[index][1])
+                t=d;
+        }
+
+        d=routes.Dist(c)[t];
+
+        if(d==1)
+            lb=min(minDirect,model.swap+minBridge);
+        else
+            lb=model.swap*(d-2)+min(minBridge,model.swap+minDirect);
+
+        return (float)(minGate*cxAfter[index+1]-hAfter[index+1]+lb);
+    };
+
+    auto push=[&](const vector<int>& layout,int index,const vector<bool>& hadamard,float g)
+    {
+        Encode(key,layout,index,hadamard);
+
+        unordered_map<string,float>::iterator it=best.find(key);
+        if(it!=best.end())
+        {
+            if(it->second<=g)
+                return;
+            it->second=g;
+        }
+        else
+            it=best.insert(make_pair(key,g)).first;
+
+        open.push({g+heuristic(layout,index),g,&it->first});
+    };
+
+    report.optimal=false;
+    report.expanded=0;
+    report.bound=0;
+
+    push(mapArray,0,vector<bool>(qubitNum,false),0);
+
+    while(!open.empty())
+    {
+        Node node=open.top();
+        open.pop();
+
+        if(best[*node.key]<node.g)
+            continue;
+
+        report.bound=node.f;
+
+        index=Decode(*node.key,layout,hadamard);
+        g=node.g;
+
+        if(index>=seqSize)
+        {
+            report.optimal=true;
+            report.bound=g;
+            mapArray=layout;
+            break;
+        }
+
+        while(index<seqSize && seq[index][0]<0)
+        {
+            for(j=0; j<qubitNum; j++)
+                if(layout[j]==seq[index][1])
+                    break;
+
+            if(seq[index][0]==-1)
+            {
+                g=g+crosstalk[j]*seq[index][2];
+                hadamard[j]=false;
+            }
+
+            else if(hadamard[j])
+            {
+                g--;
+                hadamard[j]=false;
+            }
+
+            else
+            {
+                g=g+crosstalk[j];
+                hadamard[j]=true;
+            }
+
+            index++;
+        }
+
+        if(index>=seqSize)
+        {
+            push(layout,index,hadamard,g);
+            continue;
+        }
+
+        report.expanded++;
+        if(report.expanded>nodeLimit || best.size()*(keySize+64)>memLimit)
+            break;
+
+        for(j=0; j<qubitNum; j++)
+            place[layout[j]]=j;
+
+        beg=place[seq[index][0]];
+        dest=place[seq[index][1]];
+        dist=routes.Dist(beg)[dest];
+
+        if(dist==1)
+        {
+            nextHadamard=hadamard;
+            cost=DirectCost(beg,dest,nextHadamard);
+            push(layout,index+1,nextHadamard,g+cost);
+        }
+
+        else if(dist==2)
+            for(x=0; x<qubitNum; x++)
+            {
+                k=intOf[x];
+                if(routes.Dist(beg)[k]==1 && routes.Dist(k)[dest]==1)
+                {
+                    nextHadamard=hadamard;
+                    cost=BridgeCost(beg,k,dest,nextHadamard);
+                    push(layout,index+1,nextHadamard,g+cost);
+                }
+            }
+
+        for(i=0; i<2; i++)
+        {
+            j=(i==0)?beg:dest;
+
+            for(x=0; x<qubitNum; x++)
+            {
+                k=intOf[x];
+                if(k!=j && routes.Dist(j)[k]==1 && !(i==1 && k==beg))
+                {
+                    nextLayout=layout;
+                    nextLayout[j]=layout[k];
+                    nextLayout[k]=layout[j];
+
+                    nextHadamard=hadamard;
+                    nextHadamard[j]=false;
+                    nextHadamard[k]=false;
+
+                    push(nextLayout,index,nextHadamard,g+model.swap);
+                }
+            }
+        }
+    }
+
+    report.stored=best.size();
+    report.memory=best.size()*(keySize+64);
+    report.seconds=chrono::duration<double>(chrono::steady_clock::now()-starttime).count();
+
+    if(!report.optimal)
+        return -1;
+
+    return report.bound;
+}
+
+
+/*
+ * Devices shared by all server workers, built on first use from the files
+ * under deviceDir; names that are absolute or step out of it with ".." are
+ * refused. The lock only guards the map; a device is built outside it, and
+ * workers asking for one under construction wait on its future instead of
+ * stalling the others. A device that fails to build is reported and not
+ * kept, so a corrected file is picked up by the next request.
+ */
+class DeviceCache
+{
+protected:
+    string deviceDir;
+
+    map<string,shared_future<HardwareD*>> devices;
+
+    mutex cacheLock;
+
+public:
+    DeviceCache(string deviceDir);
+
+    ~DeviceCache();
+
+    HardwareD* Get(string hwname,string& error);
+};
+
+DeviceCache::DeviceCache(string deviceDir)
+{
+    this->deviceDir=deviceDir;
+}
+
+DeviceCache::~DeviceCache()
+{
+    for(map<string,shared_future<HardwareD*>>::iterator it=devices.begin(); it!=devices.end(); it++)
+        delete it->second.get();
+}
+
+HardwareD* DeviceCache::Get(string hwname,string& error)
+{
+    promise<HardwareD*> built;
+    shared_future<HardwareD*> device;
+    DeviceOptions options;
+    HardwareD* proto;
+    size_t begin=0,end;
+
+    if(hwname.empty() || hwname[0]=='/')
+    {
+        error="invalid device name "+hwname;
+        return NULL;
+    }
+
+    while(begin<=hwname.size())
+    {
+        end=min(hwname.find('/',begin),hwname.size());
+        if(hwname.compare(begin,end-begin,"..")==0)
+        {
+            error="invalid device name "+hwname;
+            return NULL;
+        }
+        begin=end+1;
+    }
+
+    unique_lock<mutex> guard(cacheLock);
+
+    map<string,shared_future<HardwareD*>>::iterator it=devices.find(hwname);
+    if(it!=devices.end())
+    {
+        device=it->second;
+        guard.unlock();
+        proto=device.get();
+        if(proto==NULL)
+            error="cannot build device "+hwname;
+        return proto;
+    }
+
+    device=built.get_future().share();
+    devices[hwname]=device;
+    guard.unlock();
+
+    options.reportErrors=true;
+    proto=new HardwareD(deviceDir+"/"+hwname,true,false,options);
+
+    if(proto->GetError().size())
+    {
+        error=hwname+": "+proto->GetError();
+        delete proto;
+        proto=NULL;
+
+        guard.lock();
+        devices.erase(hwname);
+        guard.unlock();
+    }
+
+    built.set_value(proto);
+
+    return proto;
+}
+
+
+class RouteServer
+{
+protected:
+    int listenFd;
+
+    int workerNum;
+
+    unsigned int queueLimit;
+
+    DeviceCache cache;
+
+    deque<int> pending;
+
+    mutex queueLock;
+
+    condition_variable queueReady;
+
+    void Worker();
+
+    void Serve(int fd,map<string,HardwareD>& local);
+
+public:
+    RouteServer(int workerNum,unsigned int queueLimit,string deviceDir);
+
+    bool Listen(string socketPath);
+
+    void Run();
+};
+
+RouteServer::RouteServer(int workerNum,unsigned int queueLimit,string deviceDir):cache(deviceDir)
+{
+    this->listenFd=-1;
+    this->workerNum=workerNum;
+    this->queueLimit=queueLimit;
+}
+
+bool RouteServer::Listen(string socketPath)
+{
+    struct sockaddr_un addr;
+
+    if(socketPath.size()>=sizeof(addr.sun_path))
+    {
+        cout << "Socket path too long: " << socketPath << endl;
+        return false;
+    }
+
+    listenFd=socket(AF_UNIX,SOCK_STREAM,0);
+    if(listenFd<0)
+    {
+        cout << "Cannot create socket." << endl;
+        return false;
+    }
+
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family=AF_UNIX;
+    strcpy(addr.sun_path,socketPath.c_str());
+    unlink(socketPath.c_str());
+
+    if(bind(listenFd,(struct sockaddr*)&addr,sizeof(addr))<0 || listen(listenFd,128)<0)
+    {
+        cout << "Cannot listen on " << socketPath << endl;
+        close(listenFd);
+        listenFd=-1;
+        return false;
+    }
+
+    return true;
+}
+
+void RouteServer::Run()
+{
+    int fd;
+    vector<thread> workers;
+    const char busy[]="busy\n";
+    struct timeval timeout;
+
+    timeout.tv_sec=SocketTimeout;
+    timeout.tv_usec=0;
+
+    for(int i=0; i<workerNum; i++)
+        workers.push_back(thread(&RouteServer::Worker,this));
+
+    while(true)
+    {
+        fd=accept(listenFd,NULL,NULL);
+        if(fd<0)
+            continue;
+
+        setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+        setsockopt(fd,SOL_SOCKET,SO_SNDTIMEO,&timeout,sizeof(timeout));
+
+        unique_lock<mutex> guard(queueLock);
+        if(pending.size()>=queueLimit)
+        {
+            guard.unlock();
+            send(fd,busy,sizeof(busy)-1,MSG_NOSIGNAL);
+            close(fd);
+            continue;
+        }
+
+        pending.push_back(fd);
+        guard.unlock();
+        queueReady.notify_one();
+    }
+}
+
+void RouteServer::Worker()
+{
+    int fd;
+    map<string,HardwareD> local;
+
+    while(true)
+    {
+        unique_lock<mutex> guard(queueLock);
+        queueReady.wait(guard,[this]{return !pending.empty();});
+        fd=pending.front();
+        pending.pop_front();
+        guard.unlock();
+
+        Serve(fd,local);
+        close(fd);
+    }
+}
+
+/*
+ * One connection carries any number of jobs. A job is the device name on
+ * its own line followed by the gate pairs, terminated by an empty line or
+ * by the end of the stream. Each job is answered with "<cost> <usec>".
+ * A client that stalls for SocketTimeout seconds is dropped.
+ */
+void RouteServer::Serve(int fd,map<string,HardwareD>& local)
+{
+    char buf[65536];
+    int len,i;
+    unsigned int j;
+    bool valid;
+    float cost;
+    string line,hwname,reply,partial,error;
+    vector<vector<int>> seq;
+    vector<int> gate(2);
+    HardwareD* proto;
+    chrono::steady_clock::time_point starttime;
+    map<string,HardwareD>::iterator it;
+    bool open=true;
+
+    while(open)
+    {
+        hwname.clear();
+        seq.clear();
+
+        while(true)
+        {
+            size_t pos=partial.find('\n');
+            if(pos==string::npos)
+            {
+                len=recv(fd,buf,sizeof(buf),0);
+                if(len<0)
+                    return;
+                if(len==0)
+                {
+                    open=false;
+                    line=partial;
+                    partial.clear();
+                }
+                else
+                {
+                    partial.append(buf,len);
+                    continue;
+                }
+            }
+            else
+            {
+                line=partial.substr(0,pos);
+                partial.erase(0,pos+1);
+            }
+
+            if(line.size() && line[line.size()-1]=='\r')
+                line.erase(line.size()-1);
+
+            if(line.empty())
+            {
+                if(hwname.size() || !open)
+                    break;
+                continue;
+            }
+
+            if(hwname.empty())
+                hwname=line;
+            else if(sscanf(line.c_str(),"%d %d",&gate[0],&gate[1])==2)
+                seq.push_back(gate);
+            else
+                seq.push_back(vector<int>(2,-3));
+
+            if(!open)
+                break;
+        }
+
+        if(hwname.empty())
+            break;
+
+        starttime=chrono::steady_clock::now();
+
+        it=local.find(hwname);
+        if(it==local.end())
+        {
+            proto=cache.Get(hwname,error);
+            if(proto==NULL)
+            {
+                reply="error "+error+"\n";
+                send(fd,reply.c_str(),reply.size(),MSG_NOSIGNAL);
+                continue;
+            }
+            it=local.insert(make_pair(hwname,*proto)).first;
+        }
+
+        valid=seq.size()>0;
+        for(j=0; j<seq.size() && valid; j++)
+        {
+            i=it->second.GetQNum();
+            if(seq[j][0]<-2 || seq[j][0]>=i || seq[j][1]<0 || seq[j][1]>=i || seq[j][0]==seq[j][1])
+                valid=false;
+        }
+
+        if(!valid)
+        {
+            reply="error malformed sequence\n";
+            send(fd,reply.c_str(),reply.size(),MSG_NOSIGNAL);
+            continue;
+        }
+
+        it->second.InitMap(seq);
+        cost=it->second.Alloc(seq);
+
+        reply=to_string(cost)+" "+to_string(chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now()-starttime).count())+"\n";
+        if(send(fd,reply.c_str(),reply.size(),MSG_NOSIGNAL)<0)
+            break;
+    }
+}
+
+
+struct SplitMix
+{
+    uint64_t state;
+
+    SplitMix(uint64_t seed):state(seed) {}
+
+    uint64_t Next()
+    {
+        uint64_t z=(state+=0x9e3779b97f4a7c15ULL);
+        z=(z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+        z=(z^(z>>27))*0x94d049bb133111ebULL;
+        return z^(z>>31);
+    }
+
+    int Below(int n)
+    {
+        return (int)(((unsigned __int128)Next()*(uint64_t)n)>>64);
+    }
+
+    double Unit()
+    {
+        return (Next()>>11)*(1.0/9007199254740992.0);
+    }
+};
+
+enum GenProfile {GenRandom,GenNearest,GenLayered};
+
+struct GenSpec
+{
+    long long gates;
+    int qubits;
+    double singleFrac;
+    double hadamardFrac;
+    GenProfile profile;
+    int locality;
+    uint64_t seed;
+    int threads;
+
+    GenSpec():gates(0),qubits(16),singleFrac(0),hadamardFrac(0),profile(GenRandom),locality(1),seed(1),threads(1) {}
+};
+
+void RandSeqGen(vector<vector<int>> &seq,int qubitNum,int seqLen,uint64_t seed=1);
+
+bool GenSeqFile(const GenSpec& spec,string fname);
+
+bool ReadPackedFile(PackedSeq &seq,string fname);
+
+bool ParseQasm(PackedSeq &seq,const char* text,size_t size,string &error);
+
+bool ReadQasmFile(PackedSeq &seq,string fname,string &error);
+
+int ReadPairFile(PackedSeq &seq,string fname,string &error,int threadNum=0);
+
+string DecompressCommand(string fname);
+
+bool ReadCompressedFile(PackedSeq &seq,string command,string &error);
+
+void GetSeq(vector<vector<int>> &seq,string fname);
+
+void GetSeq(PackedSeq &seq,string fname);
+
+void PrintSeq(vector<vector<int>> seq);
+
+int GetSeqList(vector<string> &fileList, string directory);
+
+int RunDaemon(int argc,char* argv[]);
+
+int RunFused(int argc,char* argv[]);
+
+int RunLookahead(int argc,char* argv[]);
+
+int RunExact(int argc,char* argv[]);
+
+int RunSweep(int argc,char* argv[]);
+
+int RunParamSweep(int argc,char* argv[]);
+
+int RunGen(int argc,char* argv[]);
+
+struct BatchOptions
+{
+    bool peephole;
+
+    bool budgeted;
+
+    AllocBudget budget;
+
+    int windowTarget;
+};
+
+void RouteBatchCircuit(HardwareC& archA,HardwareD& archB,const BatchOptions& options,string name,const PackedSeq& circuit,ostream& os);
+
+int RunShard(HardwareC& archA,HardwareD& archB,const BatchOptions& options,const vector<string>& fileList,int shard,int shardNum,string outname);
+
+int RunMerge(int argc,char* argv[]);
+
+
+/*
+ * Runs a decompressor with popen and reads its output on its own thread into
+ * a bounded queue of blocks, so decompression, reading and parsing overlap
+ * and the uncompressed file never exists as a whole.
+ */
+class DecompressStream
+{
+protected:
+    FILE* pipe;
+
+    thread reader;
+
+    mutex lock;
+
+    condition_variable ready;
+
+    deque<vector<char>> blocks;
+
+    unsigned int queueLimit;
+
+    bool finished;
+
+    bool stopping;
+
+    void Read();
+
+public:
+    DecompressStream(string command,unsigned int queueLimit);
+
+    ~DecompressStream();
+
+    bool Next(vector<char>& block);
+
+    int Close();
+};
+
+DecompressStream::DecompressStream(string command,unsigned int queueLimit=8):queueLimit(queueLimit),finished(false),stopping(false)
+{
+    pipe=popen(command.c_str(),"r");
+
+    if(pipe)
+        reader=thread(&DecompressStream::Read,this);
+    else
+        finished=true;
+}
+
+DecompressStream::~DecompressStream()
+{
+    Close();
+}
+
+void DecompressStream::Read()
+{
+    size_t n;
+
+    while(true)
+    {
+        vector<char> block(1<<18);
+
+        n=fread(block.data(),1,block.size(),pipe);
+        block.resize(n);
+
+        unique_lock<mutex> guard(lock);
+        ready.wait(guard,[this]() {return blocks.size()<queueLimit || stopping;});
+
+        if(n==0 || stopping)
+        {
+            finished=true;
+            ready.notify_all();
+            return;
+        }
+
+        blocks.push_back(move(block));
+        ready.notify_all();
+    }
+}
+
+bool DecompressStream::Next(vector<char>& block)
+{
+    unique_lock<mutex> guard(lock);
+
+    ready.wait(guard,[this]() {return blocks.size() || finished;});
+
+    if(blocks.empty())
+        return false;
+
+    block.swap(blocks.front());
+    blocks.pop_front();
+    ready.notify_all();
+
+    return true;
+}
+
+int DecompressStream::Close()
+{
+    int status=-1;
+
+    if(!pipe)
+        return status;
+
+    {
+        lock_guard<mutex> guard(lock);
+        stopping=true;
+        ready.notify_all();
+    }
+
+    if(reader.joinable())
+        reader.join();
+
+    status=pclose(pipe);
+    pipe=NULL;
+
+    return status;
+}
+
+
+/*
+ * Loads the next circuit of a batch on a background thread while the
+ * current one is routed.
+ */
+class SeqPrefetcher
+{
+protected:
+    thread loader;
+
+    PackedSeq next;
+
+public:
+    ~SeqPrefetcher();
+
+    void Start(string fname);
+
+    void Take(PackedSeq& seq);
+};
+
+SeqPrefetcher::~SeqPrefetcher()
+{
+    if(loader.joinable())
+        loader.join();
+}
+
+void SeqPrefetcher::Start(string fname)
+{
+    if(loader.joinable())
+        loader.join();
+
+    loader=thread([this,fname]() {GetSeq(next,fname);});
+}
+
+void SeqPrefetcher::Take(PackedSeq& seq)
+{
+    if(loader.joinable())
+        loader.join();
+
+    seq.swap(next);
+}
+
+int main(int argc,char* argv[])
+{
+    if(argc>1 && string(argv[1])=="daemon")
+        return RunDaemon(argc,argv);
+
+    if(argc>1 && string(argv[1])=="fused")
+        return RunFused(argc,argv);
+
+    if(argc>1 && string(argv[1])=="lookahead")
+        return RunLookahead(argc,argv);
+
+    if(argc>1 && string(argv[1])=="exact")
+        return RunExact(argc,argv);
+
+    if(argc>1 && string(argv[1])=="sweep")
+        return RunSweep(argc,argv);
+
+    if(argc>1 && string(argv[1])=="params")
+        return RunParamSweep(argc,argv);
+
+    if(argc>1 && string(argv[1])=="gen")
+        return RunGen(argc,argv);
+
+    if(argc>1 && string(argv[1])=="merge")
+        return RunMerge(argc,argv);
+
+    int fcount;
+    int shard=-1,shardNum=0;
+    bool verbose=false;
+    BatchOptions options={false,false,{0,0},0};
+    DeviceOptions deviceOptions;
+    string outname;
+
+    for(int i=1; i<argc; i++)
+    {
+        if(string(argv[i])=="-v")
+            verbose=true;
+        else if(string(argv[i])=="-p")
+            options.peephole=true;
+        else if(string(argv[i])=="-t" && i+1<argc)
+        {
+            options.budget.seconds=atof(argv[++i]);
+            options.budgeted=true;
+        }
+        else if(string(argv[i])=="-w" && i+1<argc)
+        {
+            options.budget.work=atol(argv[++i]);
+            options.budgeted=true;
+        }
+        else if(string(argv[i])=="-s" && i+1<argc)
+        {
+            if(sscanf(argv[++i],"%d/%d",&shard,&shardNum)!=2)
             {
-                temp=mapArray[current];
-                mapArray[current]=mapArray[next];
-                mapArray[next]=temp;
+                cout << "Shard must be given as index/count." << endl;
+                return 1;
+            }
+        }
+        else if(string(argv[i])=="-o" && i+1<argc)
+            outname=argv[++i];
+        else if(string(argv[i])=="-k" && i+1<argc)
+            options.windowTarget=atoi(argv[++i]);
+        else if(string(argv[i])=="-c" && i+1<argc)
+            deviceOptions.cacheDir=argv[++i];
+    }
 
-                cost=cost+7;
+    HardwareC archA("ibmqx5",true,verbose,deviceOptions);
+    HardwareD archB("ibmqx5",true,verbose,deviceOptions);
 
-                current=next;
-                next=routeMatrix[current][dest];
+    if(options.windowTarget>0)
+    {
+        CostModel model=archA.GetCostModel();
+        model.windowTarget=options.windowTarget;
+        archA.SetCostModel(model);
+        archB.SetCostModel(model);
+    }
+
+    vector<string> fileList;
+
+    string directory="/home/tilmto/CodeBlocks/QAErrorModel/seq";
+    fcount=GetSeqList(fileList,directory);
+
+    if(shardNum>0)
+    {
+        if(shard<0 || shard>=shardNum || outname.empty())
+        {
+            cout << "Sharded runs need -s index/count with 0<=index<count and -o file." << endl;
+            return 1;
+        }
+        return RunShard(archA,archB,options,fileList,shard,shardNum,outname);
+    }
+
+    if(outname.empty())
+        outname="/home/tilmto/Ericpy/QuantumComputing/bridge/result";
+
+    ofstream os(outname,ios::out);
+    SeqPrefetcher prefetch;
+    PackedSeq circuit;
+
+    if(fcount>0)
+        prefetch.Start("seq/"+fileList[0]);
+
+    for(int i=0; i<fcount; i++)
+    {
+        prefetch.Take(circuit);
+        if(i+1<fcount)
+            prefetch.Start("seq/"+fileList[i+1]);
+
+        RouteBatchCircuit(archA,archB,options,fileList[i],circuit,os);
+    }
+
+    os.close();
+
+    return 0;
+}
+
+
+void RandSeqGen(vector<vector<int>> &seq,int qubitNum,int seqLen,uint64_t seed)
+{
+    int cqubit,squbit;
+    int i=0;
+    SplitMix rng(seed);
+
+    while(i<seqLen)
+    {
+        cqubit=rng.Below(qubitNum);
+        squbit=rng.Below(qubitNum);
+        if(cqubit!=squbit)
+        {
+            seq.push_back(vector<int>(2));
+            seq[i][0]=cqubit;
+            seq[i][1]=squbit;
+            i++;
+        }
+    }
+}
+
+
+static const char packedMagic[4]={'Q','A','X','B'};
+
+static const uint32_t packedVersion=1;
+
+static const long long genChunk=1<<20;
+
+/*
+ * Fills gates [first,first+count) of a synthetic circuit. Every chunk owns a
+ * generator seeded from (seed,chunk index), so the file does not depend on
+ * how many threads produced it. Nearest-neighbour picks a target within
+ * locality of the control on a ring nine times out of ten; layered emits
+ * disjoint CX pairs drawn from a fresh shuffle of the qubits per layer.
+ */
+static void GenChunk(const GenSpec& spec,long long chunk,long long count,Gate* out)
+{
+    SplitMix rng(spec.seed^(0xd1b54a32d192ed03ULL*(uint64_t)(chunk+1)));
+    vector<int> layer(spec.qubits);
+    int layerPos=spec.qubits;
+    int c,t,d;
+
+    for(long long i=0; i<count; i++)
+    {
+        double u=rng.Unit();
+
+        if(u<spec.hadamardFrac+spec.singleFrac)
+        {
+            out[i][0]=u<spec.hadamardFrac?-2:-1;
+            out[i][1]=rng.Below(spec.qubits);
+            out[i][2]=1;
+            continue;
+        }
+
+        if(spec.profile==GenLayered)
+        {
+            if(layerPos+1>=spec.qubits)
+            {
+                for(c=0; c<spec.qubits; c++)
+                    layer[c]=c;
+                for(c=spec.qubits-1; c>0; c--)
+                    swap(layer[c],layer[rng.Below(c+1)]);
+                layerPos=0;
             }
+            c=layer[layerPos++];
+            t=layer[layerPos++];
+        }
+        else if(spec.profile==GenNearest && rng.Below(10)<9)
+        {
+            c=rng.Below(spec.qubits);
+            d=1+rng.Below(spec.locality);
+            t=rng.Below(2)?(c+d)%spec.qubits:(c-d%spec.qubits+spec.qubits)%spec.qubits;
+            if(t==c)
+                t=(c+1)%spec.qubits;
+        }
+        else
+        {
+            c=rng.Below(spec.qubits);
+            t=rng.Below(spec.qubits-1);
+            if(t>=c)
+                t++;
+        }
 
-            if(archMatrix[current][next])
-            cost++;
-            else
-                cost=cost+5;
+        out[i][0]=c;
+        out[i][1]=t;
+        out[i][2]=1;
+    }
+}
+
+
+/*
+ * Writes a synthetic circuit straight to the packed binary format: a magic,
+ * a version word and the gate count, followed by one int triple per gate.
+ * Worker threads claim chunks and pwrite them at their fixed offsets.
+ */
+bool GenSeqFile(const GenSpec& spec,string fname)
+{
+    int fd;
+    long long chunks=(spec.gates+genChunk-1)/genChunk;
+    atomic<long long> nextChunk(0);
+    atomic<bool> failed(false);
+    vector<thread> workers;
+    char header[16];
+    uint64_t count=spec.gates;
+
+    static_assert(sizeof(Gate)==3*sizeof(int32_t),"Gate must be three packed ints");
+
+    fd=open(fname.c_str(),O_WRONLY|O_CREAT|O_TRUNC,0644);
+    if(fd<0)
+        return false;
+
+    memcpy(header,packedMagic,4);
+    memcpy(header+4,&packedVersion,4);
+    memcpy(header+8,&count,8);
+
+    if(pwrite(fd,header,16,0)!=16 || ftruncate(fd,16+spec.gates*(off_t)sizeof(Gate))!=0)
+    {
+        close(fd);
+        return false;
+    }
+
+    for(int w=0; w<max(1,spec.threads); w++)
+        workers.push_back(thread([&]()
+        {
+            vector<Gate> buffer(genChunk);
+            long long chunk,count,bytes;
+
+            while((chunk=nextChunk++)<chunks && !failed)
+            {
+                count=min(genChunk,spec.gates-chunk*genChunk);
+                bytes=count*sizeof(Gate);
+                GenChunk(spec,chunk,count,buffer.data());
+                if(pwrite(fd,buffer.data(),bytes,16+chunk*genChunk*(off_t)sizeof(Gate))!=bytes)
+                    failed=true;
+            }
+        }));
+
+    for(unsigned int w=0; w<workers.size(); w++)
+        workers[w].join();
+
+    return close(fd)==0 && !failed;
+}
+
+
+bool ReadPackedFile(PackedSeq &seq,string fname)
+{
+    char header[16];
+    uint32_t version;
+    uint64_t count;
+    struct stat st;
+
+    seq.clear();
+
+    ifstream is(fname,ios::in|ios::binary);
+
+    if(!is.read(header,16) || memcmp(header,packedMagic,4)!=0)
+        return false;
+
+    memcpy(&version,header+4,4);
+    memcpy(&count,header+8,8);
+    if(version!=packedVersion || stat(fname.c_str(),&st)!=0)
+        return false;
+
+    if(count>(uint64_t)st.st_size/sizeof(Gate) || 16+count*sizeof(Gate)!=(uint64_t)st.st_size)
+        return false;
+
+    seq.resize(count);
+    if(!is.read((char*)seq.data(),count*sizeof(Gate)))
+    {
+        seq.clear();
+        return false;
+    }
+
+    return true;
+}
+
+
+static bool IsPackedFile(string fname)
+{
+    char magic[4];
+    ifstream is(fname,ios::in|ios::binary);
+
+    return is.read(magic,4) && memcmp(magic,packedMagic,4)==0;
+}
+
+
+static bool IsQasmFile(string fname)
+{
+    char head[256];
+    ifstream is(fname,ios::in|ios::binary);
+    int n,i=0;
+
+    is.read(head,sizeof(head));
+    n=is.gcount();
+
+    while(i<n)
+    {
+        if(isspace((unsigned char)head[i]))
+            i++;
+        else if(i+1<n && head[i]=='/' && head[i+1]=='/')
+            while(i<n && head[i]!='\n')
+                i++;
+        else
+            break;
+    }
+
+    return n-i>=8 && memcmp(head+i,"OPENQASM",8)==0;
+}
+
+
+void GetSeq(vector<vector<int>> &seq,string fname)
+{
+    PackedSeq packed;
+
+    seq.clear();
+
+    GetSeq(packed,fname);
+
+    for(unsigned int j=0; j<packed.size(); j++)
+        for(int k=0; k<packed[j][2]; k++)
+            seq.push_back(vector<int>{packed[j][0],packed[j][1]});
+}
+
+
+void GetSeq(PackedSeq &seq,string fname)
+{
+    string error,command;
+
+    command=DecompressCommand(fname);
+    if(command.size())
+    {
+        if(!ReadCompressedFile(seq,command,error))
+        {
+            cout << "Bad compressed seq file " << fname << ": " << error << endl;
+            exit(1);
+        }
+        return;
+    }
+
+    if(IsPackedFile(fname))
+    {
+        if(!ReadPackedFile(seq,fname))
+        {
+            cout << "Bad packed seq file." << endl;
+            exit(1);
+        }
+        return;
+    }
+
+    if(IsQasmFile(fname))
+    {
+        if(!ReadQasmFile(seq,fname,error))
+        {
+            cout << "Bad QASM file " << fname << ": " << error << endl;
+            exit(1);
         }
+        return;
+    }
+
+    switch(ReadPairFile(seq,fname,error))
+    {
+    case -1:
+        cout << "No such seq file." << endl;
+        exit(1);
+
+    case 0:
+        cout << "Bad seq file " << fname << ": " << error << endl;
+        exit(1);
     }
+}
+
+
+/*
+ * OpenQASM 2.0 reader writing straight into the allocator encoding: cx gives
+ * (control,target), h gives (-2,q) and every other one-qubit gate (-1,q).
+ * qregs are numbered in declaration order; an argument naming a whole
+ * register broadcasts the gate over it. Gate bodies, measure, barrier and
+ * reset are skipped; user gates on one qubit count as single-qubit gates.
+ * Names are compared in place, so only the output sequence allocates.
+ */
+bool ParseQasm(PackedSeq &seq,const char* text,size_t size,string &error)
+{
+    struct Name
+    {
+        const char* str;
+        int len;
+        int offset;
+        int size;
+    };
+
+    const char* p=text;
+    const char* end=text+size;
+    const char* word;
+    int wordLen,line=1,qubits=0,argNum,n,k,a;
+    vector<Name> qregs,gates;
+    Name args[2];
+    unsigned int lastReg=0;
+    static const char* singles[]={"x","y","z","s","sdg","t","tdg","sx","sxdg","rx","ry","rz","u","u1","u2","u3","U","p","id"};
+
+    auto fail=[&](string msg)
+    {
+        error="line "+to_string(line)+": "+msg;
+        return false;
+    };
+
+    auto skipSpace=[&]()
+    {
+        while(p<end)
+        {
+            if(*p=='\n')
+            {
+                line++;
+                p++;
+            }
+            else if(*p==' ' || *p=='\t' || *p=='\r')
+                p++;
+            else if(*p=='/' && p+1<end && p[1]=='/')
+                while(p<end && *p!='\n')
+                    p++;
+            else
+                break;
+        }
+    };
+
+    auto ident=[&]()
+    {
+        skipSpace();
+        word=p;
+        while(p<end && (((*p|32)>='a' && (*p|32)<='z') || (*p>='0' && *p<='9') || *p=='_'))
+            p++;
+        wordLen=p-word;
+        return wordLen>0;
+    };
+
+    auto is=[&](const char* s)
+    {
+        int i=0;
+
+        while(i<wordLen && s[i]==word[i])
+            i++;
+        return i==wordLen && s[i]==0;
+    };
+
+    auto expect=[&](char c)
+    {
+        skipSpace();
+        if(p<end && *p==c)
+        {
+            p++;
+            return true;
+        }
+        return false;
+    };
+
+    auto number=[&](int& v)
+    {
+        skipSpace();
+        v=0;
+        if(p>=end || *p<'0' || *p>'9')
+            return false;
+        while(p<end && *p>='0' && *p<='9')
+            v=v*10+(*p++-'0');
+        return true;
+    };
+
+    auto skipPast=[&](char c)
+    {
+        while(p<end && *p!=c)
+            if(*p++=='\n')
+                line++;
+        if(p<end)
+            p++;
+        return p<=end;
+    };
+
+    auto find=[&](vector<Name>& names)
+    {
+        for(unsigned int i=0; i<names.size(); i++)
+            if(names[i].len==wordLen && memcmp(names[i].str,word,wordLen)==0)
+                return (int)i;
+        return -1;
+    };
+
+    auto findReg=[&]()
+    {
+        if(lastReg<qregs.size() && qregs[lastReg].len==wordLen && memcmp(qregs[lastReg].str,word,wordLen)==0)
+            return (int)lastReg;
+        lastReg=find(qregs);
+        return (int)lastReg;
+    };
 
-    return cost;
-}
+    seq.reserve(seq.size()+size/12);
 
-class HardwareB:public HardwareA
-{
-protected:
-    vector<int> sgateNum;
+    while(true)
+    {
+        skipSpace();
+        if(p>=end)
+            break;
 
-public:
-    HardwareB(string hwname,bool isUniDirection);
+        if(!ident())
+            return fail(string("unexpected '")+*p+"'");
 
-    float Alloc(vector<vector<int>> seq);
-};
+        if(wordLen>=4 && (is("OPENQASM") || is("include") || is("creg") || is("measure") || is("barrier") || is("reset") || is("opaque")))
+            skipPast(';');
 
-HardwareB::HardwareB(string hwname,bool isUniDirection=true):HardwareA(hwname,isUniDirection)
-{
-    for(int i=0; i<qubitNum; i++)
-        sgateNum.push_back(0);
-}
+        else if(wordLen==4 && is("qreg"))
+        {
+            Name reg;
 
-float HardwareB::Alloc(vector<vector<int>> seq)
-{
-    unsigned int i;
-    float minsgc,cost=0;
-    int j,temp, beg,current,next,dest;
+            if(!ident() || !expect('[') || !number(n) || !expect(']') || !expect(';'))
+                return fail("malformed qreg");
 
-    for(i=0; i<seq.size(); i++)
-    {
-        if(seq[i][0]<0)
-            for(j=0; j<qubitNum; j++)
+            reg={word,wordLen,qubits,n};
+            qregs.push_back(reg);
+            qubits=qubits+n;
+        }
+
+        else if(wordLen==4 && is("gate"))
+        {
+            Name gate;
+
+            if(!ident())
+                return fail("malformed gate definition");
+            gate={word,wordLen,0,0};
+            if(expect('('))
+                skipPast(')');
+            while(ident())
             {
-                if(mapArray[j]==seq[i][1])
-                {
-                    sgateNum[j]++;
+                gate.size++;
+                if(!expect(','))
                     break;
-                }
             }
+            if(!expect('{'))
+                return fail("malformed gate definition");
+            skipPast('}');
+            gates.push_back(gate);
+        }
+
+        else if(wordLen==2 && is("if"))
+            return fail("classically controlled gates are not supported");
 
         else
         {
-            for(j=0; j<qubitNum; j++)
-            {
-                if(mapArray[j]==seq[i][1])
-                    beg=j;
+            const char* gateName=word;
+            int gateLen=wordLen,arity=-1,kind;
 
-                if(mapArray[j]==seq[i][0])
-                    dest=j;
+            if(is("cx") || is("CX"))
+            {
+                arity=2;
+                kind=0;
+            }
+            else if(is("h"))
+            {
+                arity=1;
+                kind=-2;
+            }
+            else
+            {
+                for(k=0; k<(int)(sizeof(singles)/sizeof(singles[0])) && arity<0; k++)
+                    if(is(singles[k]))
+                        arity=1;
+                if(arity<0 && (k=find(gates))>=0 && gates[k].size==1)
+                    arity=1;
+                kind=-1;
             }
 
-            if(crosstalk[dest]>crosstalk[beg])
+            if(arity<0)
+                return fail("unsupported gate "+string(gateName,gateLen));
+
+            if(expect('('))
             {
-                temp=beg;
-                beg=dest;
-                dest=temp;
+                for(k=1; k>0 && p<end; p++)
+                    if(*p=='(')
+                        k++;
+                    else if(*p==')')
+                        k--;
+                    else if(*p=='\n')
+                        line++;
             }
 
-            cost=cost+crosstalk[dest]*sgateNum[dest];
-            sgateNum[dest]=0;
+            for(argNum=0; ; )
+            {
+                if(!ident() || (k=findReg())<0)
+                    return fail("unknown register in "+string(gateName,gateLen));
+                if(argNum==arity)
+                    return fail("too many arguments to "+string(gateName,gateLen));
 
-            minsgc=crosstalk[beg];
+                args[argNum]=qregs[k];
+                if(expect('['))
+                {
+                    if(!number(a) || !expect(']') || a>=qregs[k].size)
+                        return fail("bad qubit index");
+                    args[argNum].offset=qregs[k].offset+a;
+                    args[argNum].size=1;
+                }
+                argNum++;
 
-            next=routeMatrix[beg][dest];
+                if(!expect(','))
+                    break;
+            }
 
-            current=beg;
+            if(argNum!=arity || !expect(';'))
+                return fail("malformed "+string(gateName,gateLen));
 
-            while(next!=dest)
+            n=args[0].size;
+            if(arity==2)
             {
-                temp=mapArray[current];
-                mapArray[current]=mapArray[next];
-                mapArray[next]=temp;
+                if(n>1 && args[1].size>1 && n!=args[1].size)
+                    return fail("register sizes differ");
+                n=max(n,args[1].size);
+            }
 
-                cost=cost+7;
-                current=next;
-                next=routeMatrix[current][dest];
+            for(k=0; k<n; k++)
+            {
+                if(arity==2)
+                {
+                    Gate g={args[0].offset+(args[0].size>1?k:0),args[1].offset+(args[1].size>1?k:0),1};
 
-                if(crosstalk[current]<minsgc)
-                    minsgc=crosstalk[current];
+                    if(g[0]==g[1])
+                        return fail("cx on a single qubit");
+                    seq.push_back(g);
+                }
+                else
+                    seq.push_back(Gate{kind,args[0].offset+k,1});
             }
+        }
+    }
 
-            if(archMatrix[current][next])
-                cost++;
-            else
-                cost=cost+5;
+    return true;
+}
 
-            cost=cost+minsgc*sgateNum[beg];
-            sgateNum[beg]=0;
-        }
+
+bool ReadQasmFile(PackedSeq &seq,string fname,string &error)
+{
+    int fd;
+    struct stat st;
+    void* text;
+    bool ok;
+
+    seq.clear();
+
+    fd=open(fname.c_str(),O_RDONLY);
+    if(fd<0 || fstat(fd,&st)!=0)
+    {
+        if(fd>=0)
+            close(fd);
+        error="cannot open";
+        return false;
     }
 
-    for(j=0;j<qubitNum;j++)
-        if(sgateNum[j]!=0)
-        {
-            cost=cost+crosstalk[j]*sgateNum[j];
-            sgateNum[j]=0;
-        }
+    if(st.st_size==0)
+    {
+        close(fd);
+        return true;
+    }
 
-    return cost;
-}
+    text=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE|MAP_POPULATE,fd,0);
+    close(fd);
+    if(text==MAP_FAILED)
+    {
+        error="cannot map";
+        return false;
+    }
 
+    madvise(text,st.st_size,MADV_SEQUENTIAL);
+    ok=ParseQasm(seq,(const char*)text,st.st_size,error);
+    munmap(text,st.st_size);
 
-int frac(int n);
+    return ok;
+}
 
-class HardwareC:public HardwareA
+
+struct PairChunk
 {
-public:
-    HardwareC(string hwname,bool isUniDirection);
+    const char* begin;
 
-    void InitMap(vector<vector<int>> seq);
+    const char* end;
 
-    float Alloc(vector<vector<int>> seq);
+    PackedSeq gates;
+
+    long lines;
 
-    void SubAlloc(vector<vector<int>> worklist,vector<int> mapArray,vector<bool> hadamard,vector<bool>& minhadamard,vector<int>& minmap,int& mincost);
+    long errorLine;
+
+    string error;
 };
 
-HardwareC::HardwareC(string hwname,bool isUniDirection=true):HardwareA(hwname,isUniDirection) {}
 
-void HardwareC::InitMap(vector<vector<int>> seq)
+/*
+ * Parses one newline-aligned chunk of "control target" lines. Blank lines
+ * are skipped; anything else that is not exactly two integers stops the
+ * chunk with the chunk-local line number of the offending line. A leading
+ * '+' is accepted, as the stream parser did.
+ */
+static void ParsePairChunk(PairChunk& chunk)
 {
-    int i;
-    unsigned int j;
-    vector<int> freq(qubitNum,0);
-    vector<int> sortFreq(1,0);
-    vector<int> sortOutDeg;
+    const char* p=chunk.begin;
+    const char* end=chunk.end;
+    int v[2];
+    from_chars_result r;
 
-    for(j=0; j<seq.size(); j++)
-        if(seq[j][0]>=0)
-            freq[seq[j][1]]++;
+    chunk.lines=0;
+    chunk.errorLine=0;
+    chunk.gates.reserve((end-p)/4);
 
-    for(i=1; i<qubitNum; i++)
-        for(j=0; j<sortFreq.size(); j++)
+    auto blank=[&]()
+    {
+        while(p<end && (*p==' ' || *p=='\t' || *p=='\r'))
+            p++;
+    };
+
+    while(p<end)
+    {
+        chunk.lines++;
+        blank();
+
+        if(p<end && *p=='\n')
         {
-            if(freq[i]>freq[sortFreq[j]])
+            p++;
+            continue;
+        }
+
+        for(int k=0; k<2; k++)
+        {
+            if(p+1<end && *p=='+' && isdigit((unsigned char)p[1]))
+                p++;
+
+            r=from_chars(p,end,v[k]);
+            if(r.ec!=errc())
             {
-                sortFreq.insert(sortFreq.begin()+j,i);
-                break;
+                chunk.errorLine=chunk.lines;
+                chunk.error=r.ec==errc::result_out_of_range?"integer out of range":"expected two integers";
+                return;
             }
+            p=r.ptr;
 
-            if(j==sortFreq.size()-1)
+            if(k==0 && (p>=end || (*p!=' ' && *p!='\t')))
             {
-                sortFreq.push_back(i);
-                break;
+                chunk.errorLine=chunk.lines;
+                chunk.error="expected two integers";
+                return;
             }
+            blank();
+        }
+
+        if(p<end && *p!='\n')
+        {
+            chunk.errorLine=chunk.lines;
+            chunk.error="trailing characters";
+            return;
         }
 
-    sortOutDeg.push_back(4);
-    sortOutDeg.push_back(13);
-    sortOutDeg.push_back(12);
-    sortOutDeg.push_back(5);
-    sortOutDeg.push_back(3);
-    sortOutDeg.push_back(14);
-    sortOutDeg.push_back(6);
-    sortOutDeg.push_back(11);
-    sortOutDeg.push_back(10);
-    sortOutDeg.push_back(7);
-    sortOutDeg.push_back(15);
-    sortOutDeg.push_back(2);
-    sortOutDeg.push_back(0);
-    sortOutDeg.push_back(9);
-    sortOutDeg.push_back(8);
-    sortOutDeg.push_back(1);
+        if(p<end)
+            p++;
+
+        chunk.gates.push_back(Gate{v[0],v[1],1});
+    }
+}
+
 
 /*
-        //ibmqxm
-        sortOutDeg.push_back(6);
-        sortOutDeg.push_back(5);
-        sortOutDeg.push_back(10);
-        sortOutDeg.push_back(9);
-        sortOutDeg.push_back(7);
-        sortOutDeg.push_back(2);
-        sortOutDeg.push_back(1);
-        sortOutDeg.push_back(4);
-        sortOutDeg.push_back(13);
-        sortOutDeg.push_back(14);
-        sortOutDeg.push_back(8);
-        sortOutDeg.push_back(11);
-        sortOutDeg.push_back(15);
-        sortOutDeg.push_back(12);
-        sortOutDeg.push_back(0);
-        sortOutDeg.push_back(3);
-*/
+ * Loads a text pair file by mapping it, cutting it into newline-aligned
+ * chunks and parsing the chunks on separate threads. The chunks are then
+ * concatenated in file order, and the first malformed line reports its
+ * line number in the whole file. Returns 1 on success, 0 on a parse error
+ * and -1 when the file cannot be read.
+ */
+int ReadPairFile(PackedSeq &seq,string fname,string &error,int threadNum)
+{
+    int fd;
+    struct stat st;
+    const char* text;
+    const char* cut;
+    size_t chunkNum,target,total=0;
+    long lines=0;
+    vector<PairChunk> chunks;
+    vector<thread> workers;
+    atomic<size_t> nextChunk(0);
 
-    for(i=0; i<qubitNum; i++)
-        mapArray[sortOutDeg[i]]=sortFreq[i];
+    seq.clear();
+
+    fd=open(fname.c_str(),O_RDONLY);
+    if(fd<0 || fstat(fd,&st)!=0)
+    {
+        if(fd>=0)
+            close(fd);
+        return -1;
+    }
+
+    if(st.st_size==0)
+    {
+        close(fd);
+        return 1;
+    }
+
+    text=(const char*)mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE|MAP_POPULATE,fd,0);
+    close(fd);
+    if(text==MAP_FAILED)
+        return -1;
+
+    if(threadNum<=0)
+        threadNum=thread::hardware_concurrency();
+    threadNum=max(1,threadNum);
+    chunkNum=max((size_t)1,min((size_t)threadNum*4,(size_t)st.st_size/(1<<18)));
+    target=st.st_size/chunkNum;
+
+    for(const char* p=text; p<text+st.st_size; p=cut)
+    {
+        cut=(const char*)memchr(min(p+target,text+st.st_size-1),'\n',text+st.st_size-min(p+target,text+st.st_size-1));
+        cut=cut?cut+1:text+st.st_size;
+
+        PairChunk chunk;
+        chunk.begin=p;
+        chunk.end=cut;
+        chunks.push_back(chunk);
+    }
+
+    for(int w=0; w<min(threadNum,(int)chunks.size()); w++)
+        workers.push_back(thread([&]()
+        {
+            size_t c;
+
+            while((c=nextChunk++)<chunks.size())
+                ParsePairChunk(chunks[c]);
+        }));
+
+    for(unsigned int w=0; w<workers.size(); w++)
+        workers[w].join();
+
+    munmap((void*)text,st.st_size);
 
+    for(size_t c=0; c<chunks.size(); c++)
+    {
+        if(chunks[c].errorLine)
+        {
+            error="line "+to_string(lines+chunks[c].errorLine)+": "+chunks[c].error;
+            return 0;
+        }
+        lines=lines+chunks[c].lines;
+        total=total+chunks[c].gates.size();
+    }
+
+    seq.resize(total);
+    total=0;
+    for(size_t c=0; c<chunks.size(); c++)
+    {
+        copy(chunks[c].gates.begin(),chunks[c].gates.end(),seq.begin()+total);
+        total=total+chunks[c].gates.size();
+    }
+
+    return 1;
 }
 
 
-float HardwareC::Alloc(vector<vector<int>> seq)
+string DecompressCommand(string fname)
 {
-    int i,j;
-    int m,n,seqLen,permuteNum,record,cnt,mincost;
-    float totalcost=0;
-    bool flag=false;
-    vector<vector<int>> worklist;
-    vector<int> minmap;
-    vector<int> temp;
-    vector<bool> hadamard(qubitNum,false);
-    vector<bool> minhadamard;
-    vector<bool> seqitem(seq.size(),true);
-    vector<bool> vacant(qubitNum,true);
+    unsigned char magic[4]={0,0,0,0};
+    string quoted="'";
+    ifstream is(fname,ios::in|ios::binary);
 
-    record=seq.size();
-    cnt=0;
+    is.read((char*)magic,4);
+
+    for(unsigned int i=0; i<fname.size(); i++)
+        quoted+=fname[i]=='\''?string("'\\''"):string(1,fname[i]);
+    quoted+="'";
 
-    for(i=0; i<seq.size();i++)
+    if(magic[0]==0x1f && magic[1]==0x8b)
+        return "gzip -dc -- "+quoted;
+
+    if(magic[0]==0x28 && magic[1]==0xb5 && magic[2]==0x2f && magic[3]==0xfd)
+        return "zstd -dcq -- "+quoted;
+
+    return "";
+}
+
+
+/*
+ * Parses the output of a decompressor block by block. Text pair files are
+ * parsed as whole lines arrive, carrying a partial line into the next
+ * block; packed binary records are copied as they complete. QASM refers
+ * back to register names, so it is collected and parsed in one piece.
+ */
+bool ReadCompressedFile(PackedSeq &seq,string command,string &error)
+{
+    DecompressStream stream(command+" 2>/dev/null");
+    vector<char> block,carry;
+    PairChunk chunk;
+    long lines=0;
+    uint32_t version;
+    uint64_t count=0;
+    const char* last;
+    int format=-1;
+    size_t i;
+
+    seq.clear();
+
+    while(stream.Next(block))
     {
-        if(flag)
-            cnt++;
+        carry.insert(carry.end(),block.begin(),block.end());
 
-        if(seq[i][0]==-1 && seqitem[i])
+        if(format<0)
         {
-            if(vacant[seq[i][1]])
+            for(i=0; i<carry.size() && isspace((unsigned char)carry[i]); i++);
+
+            if(carry.size()>=16 && memcmp(carry.data(),packedMagic,4)==0)
             {
-                for(j=0; j<qubitNum; j++)
+                memcpy(&version,carry.data()+4,4);
+                memcpy(&count,carry.data()+8,8);
+                if(version!=packedVersion)
                 {
-                    if(mapArray[j]==seq[i][1])
-                        break;
+                    error="unsupported packed version";
+                    return false;
                 }
-
-                totalcost=totalcost+crosstalk[j];
-
-                hadamard[j]=false;
-
-                seqitem[i]=false;
+                carry.erase(carry.begin(),carry.begin()+16);
+                format=1;
             }
+            else if(carry.size()-i>=8 && (memcmp(carry.data()+i,"OPENQASM",8)==0 || memcmp(carry.data()+i,"//",2)==0))
+                format=2;
+            else if(carry.size()>=16)
+                format=0;
+            else
+                continue;
+        }
 
-            else if(record>i)
+        if(format==0)
+        {
+            last=(const char*)memrchr(carry.data(),'\n',carry.size());
+            if(!last)
+                continue;
+
+            chunk.begin=carry.data();
+            chunk.end=last+1;
+            chunk.gates.clear();
+            ParsePairChunk(chunk);
+            if(chunk.errorLine)
             {
-                record=i;
-                flag=true;
+                error="line "+to_string(lines+chunk.errorLine)+": "+chunk.error;
+                return false;
             }
+            lines=lines+chunk.lines;
+            seq.insert(seq.end(),chunk.gates.begin(),chunk.gates.end());
+            carry.erase(carry.begin(),carry.begin()+(chunk.end-carry.data()));
         }
 
-        else if(seq[i][0]==-2 && seqitem[i])
+        else if(format==1)
         {
-            if(vacant[seq[i][1]])
-            {
-                for(j=0; j<qubitNum; j++)
-                {
-                    if(mapArray[j]==seq[i][1])
-                        break;
-                }
+            i=carry.size()/sizeof(Gate);
+            seq.resize(seq.size()+i);
+            memcpy(&seq[seq.size()-i],carry.data(),i*sizeof(Gate));
+            carry.erase(carry.begin(),carry.begin()+i*sizeof(Gate));
+        }
+    }
 
-                if(hadamard[j])
-                {
-                    totalcost--;
-                    hadamard[j]=false;
-                }
+    if(stream.Close()!=0)
+    {
+        error="decompression failed";
+        return false;
+    }
 
-                else
-                {
-                    totalcost=totalcost+crosstalk[j];
+    if(format<0)
+    {
+        for(i=0; i<carry.size() && isspace((unsigned char)carry[i]); i++);
+        format=((carry.size()-i>=8 && memcmp(carry.data()+i,"OPENQASM",8)==0) || (carry.size()-i>=2 && memcmp(carry.data()+i,"//",2)==0))?2:0;
+    }
 
-                    hadamard[j]=true;
-                }
+    if(format==2)
+        return ParseQasm(seq,carry.data(),carry.size(),error);
 
-                seqitem[i]=false;
-            }
+    if(format==1 && (carry.size() || seq.size()!=count))
+    {
+        error="truncated packed sequence";
+        return false;
+    }
 
-            else if(record>i)
-            {
-                record=i;
-                flag=true;
-            }
+    if(format==0 && carry.size())
+    {
+        chunk.begin=carry.data();
+        chunk.end=carry.data()+carry.size();
+        chunk.gates.clear();
+        ParsePairChunk(chunk);
+        if(chunk.errorLine)
+        {
+            error="line "+to_string(lines+chunk.errorLine)+": "+chunk.error;
+            return false;
         }
+        seq.insert(seq.end(),chunk.gates.begin(),chunk.gates.end());
+    }
 
-        else if(seq[i][0]>=0 && seqitem[i])
-        {
-            if(vacant[seq[i][0]] && vacant[seq[i][1]])
-            {
-                worklist.push_back(seq[i]);
-                vacant[seq[i][0]]=false;
-                vacant[seq[i][1]]=false;
-                seqitem[i]=false;
-            }
+    return true;
+}
+
+
+void PackSeq(PackedSeq &packed,const vector<vector<int>> &seq)
+{
+    packed.resize(seq.size());
+
+    for(unsigned int i=0; i<seq.size(); i++)
+    {
+        packed[i][0]=seq[i][0];
+        packed[i][1]=seq[i][1];
+        packed[i][2]=1;
+    }
+}
+
+
+uint64_t Fnv1a(uint64_t hash,const void* data,size_t size)
+{
+    const unsigned char* p=(const unsigned char*)data;
+
+    for(size_t i=0; i<size; i++)
+        hash=(hash^p[i])*0x100000001b3ULL;
+
+    return hash;
+}
+
+
+/*
+ * Checkpoint file: a QAXK magic, a version and the count, then per checkpoint
+ * its scalars followed by length-prefixed int arrays (hadamard as 0/1 ints).
+ */
+bool SaveCheckpoints(const vector<AllocCheckpoint>& checkpoints,string fname)
+{
+    ofstream os(fname,ios::out|ios::binary);
+    uint32_t version=1,count=checkpoints.size();
+    auto put=[&](const void* data,size_t size) {os.write((const char*)data,size);};
+    auto putInts=[&](const vector<int>& v) {uint32_t n=v.size(); put(&n,4); put(v.data(),n*sizeof(int));};
 
-            else if(record>i)
-            {
-                record=i;
-                flag=true;
-            }
-        }
+    put("QAXK",4);
+    put(&version,4);
+    put(&count,4);
 
-        if(cnt>=Readahead || i==seq.size()-1)
-        {
-            if(worklist.size())
-            {
-                mincost=infinity;
-                seqLen=worklist.size();
+    for(unsigned int k=0; k<checkpoints.size(); k++)
+    {
+        const AllocCheckpoint& cp=checkpoints[k];
+
+        put(&cp.next,sizeof(int));
+        put(&cp.scanned,sizeof(int));
+        put(&cp.prefixHash,sizeof(uint64_t));
+        put(&cp.totalcost,sizeof(float));
+        putInts(cp.mapArray);
+        putInts(vector<int>(cp.hadamard.begin(),cp.hadamard.end()));
+        putInts(cp.sgateNum);
+        putInts(cp.doneAfter);
+    }
 
-                if(seqLen==1)
-                    SubAlloc(worklist,mapArray,hadamard,minhadamard,minmap,mincost);
+    return os.good();
+}
 
-                else
-                {
-                    permuteNum=frac(seqLen);
-                    m=0;
-                    while(m<permuteNum)
-                    {
-                        for(n=seqLen-1; n>0; n--)
-                        {
-                            temp=worklist[n];
-                            worklist[n]=worklist[n-1];
-                            worklist[n-1]=temp;
-                            m++;
-                            SubAlloc(worklist,mapArray,hadamard,minhadamard,minmap,mincost);
-                        }
-
-                        temp=worklist[seqLen-1];
-                        worklist[seqLen-1]=worklist[seqLen-2];
-                        worklist[seqLen-2]=temp;
-                        m++;
-                        SubAlloc(worklist,mapArray,hadamard,minhadamard,minmap,mincost);
-
-                        for(n=0; n<seqLen-1; n++)
-                        {
-                            temp=worklist[n];
-                            worklist[n]=worklist[n+1];
-                            worklist[n+1]=temp;
-                            m++;
-                            SubAlloc(worklist,mapArray,hadamard,minhadamard,minmap,mincost);
-                        }
-
-                        temp=worklist[0];
-                        worklist[0]=worklist[1];
-                        worklist[1]=temp;
-                        m++;
-                        SubAlloc(worklist,mapArray,hadamard,minhadamard,minmap,mincost);
-                    }
-                }
 
-                mapArray=minmap;
-                hadamard=minhadamard;
-                totalcost=totalcost+mincost;
-                worklist.clear();
-            }
+bool LoadCheckpoints(vector<AllocCheckpoint>& checkpoints,string fname)
+{
+    ifstream is(fname,ios::in|ios::binary);
+    char magic[4];
+    uint32_t version=0,count=0;
+    vector<int> bits;
+    auto get=[&](void* data,size_t size) {return (bool)is.read((char*)data,size);};
+    auto getInts=[&](vector<int>& v)
+    {
+        uint32_t n;
+        if(!get(&n,4) || n>(1u<<28))
+            return false;
+        v.resize(n);
+        return get(v.data(),n*sizeof(int));
+    };
 
-            for(j=0;j<qubitNum;j++)
-                vacant[j]=true;
+    checkpoints.clear();
 
-            i=record-1;
-            record=seq.size();
-            cnt=0;
-            flag=false;
+    if(!get(magic,4) || memcmp(magic,"QAXK",4)!=0 || !get(&version,4) || version!=1 || !get(&count,4))
+        return false;
+
+    checkpoints.resize(count);
+
+    for(unsigned int k=0; k<count; k++)
+    {
+        AllocCheckpoint& cp=checkpoints[k];
+
+        if(!get(&cp.next,sizeof(int)) || !get(&cp.scanned,sizeof(int)) || !get(&cp.prefixHash,sizeof(uint64_t))
+           || !get(&cp.totalcost,sizeof(float)) || !getInts(cp.mapArray) || !getInts(bits)
+           || !getInts(cp.sgateNum) || !getInts(cp.doneAfter))
+        {
+            checkpoints.clear();
+            return false;
         }
+
+        cp.hadamard.assign(bits.begin(),bits.end());
     }
 
-    return totalcost;
+    return true;
 }
 
-void HardwareC::SubAlloc(vector<vector<int>> worklist,vector<int> mapArray,vector<bool> hadamard,vector<bool>& minhadamard,vector<int>& minmap,int& mincost)
+
+/*
+ * Removes H-H and CX-CX pairs that meet on the same qubits with nothing in
+ * between and folds runs of single-qubit gates into one counted entry.
+ * top[q] is the last surviving entry on qubit q and prev[] links each entry
+ * to the one it covered, so cancellations expose earlier gates in O(1).
+ * Returns the number of entries removed.
+ */
+int Peephole(PackedSeq &seq)
 {
-    unsigned int i;
-    int j,current,next,dest,temp,cost=0;
+    unsigned int i,k;
+    int c,t,last;
+    int qubitNum=0;
+    PackedSeq out;
+    vector<array<int,2>> prev;
+    vector<bool> alive;
 
-    for(i=0; i<worklist.size(); i++)
+    for(i=0; i<seq.size(); i++)
     {
-        for(j=0; j<qubitNum; j++)
-        {
-            if(mapArray[j]==worklist[i][0])
-                current=j;
+        if(seq[i][0]>=qubitNum)
+            qubitNum=seq[i][0]+1;
+        if(seq[i][1]>=qubitNum)
+            qubitNum=seq[i][1]+1;
+    }
 
-            if(mapArray[j]==worklist[i][1])
-                dest=j;
-        }
+    vector<int> top(qubitNum,-1);
 
-        next=routeMatrix[current][dest];
+    out.reserve(seq.size());
+    prev.reserve(seq.size());
+    alive.reserve(seq.size());
 
-        if(next==dest)
+    for(i=0; i<seq.size(); i++)
+    {
+        t=seq[i][1];
+        last=top[t];
+
+        if(seq[i][0]<0)
         {
-            if(archMatrix[current][next])
+            if(last>=0 && seq[i][0]==-2 && out[last][0]==-2)
             {
-                cost++;
-                hadamard[current]=false;
-                hadamard[next]=false;
+                alive[last]=false;
+                top[t]=prev[last][1];
+                continue;
             }
 
-            else
+            if(last>=0 && seq[i][0]==-1 && out[last][0]==-1)
             {
-                cost=cost+5;
-
-                if(hadamard[current])
-                    cost=cost-2;
-                else
-                    hadamard[current]=true;
-
-                if(hadamard[next])
-                    cost=cost-2;
-                else
-                    hadamard[next]=true;
+                out[last][2]=out[last][2]+seq[i][2];
+                continue;
             }
+
+            prev.push_back({-1,last});
+            top[t]=out.size();
         }
 
         else
         {
-            while(routeMatrix[next][dest]!=dest)
+            c=seq[i][0];
+
+            if(last>=0 && top[c]==last && out[last][0]==c && out[last][1]==t)
             {
-                temp=mapArray[current];
-                mapArray[current]=mapArray[next];
-                mapArray[next]=temp;
+                alive[last]=false;
+                top[c]=prev[last][0];
+                top[t]=prev[last][1];
+                continue;
+            }
 
-                cost=cost+7;
+            prev.push_back({top[c],last});
+            top[c]=out.size();
+            top[t]=out.size();
+        }
 
-                hadamard[current]=false;
-                hadamard[next]=false;
+        out.push_back(seq[i]);
+        alive.push_back(true);
+    }
 
-                current=next;
-                next=routeMatrix[current][dest];
-            }
+    for(i=0,k=0; i<out.size(); i++)
+        if(alive[i])
+            out[k++]=out[i];
+    out.resize(k);
 
-            if(archMatrix[current][next] && archMatrix[next][dest])
-            {
-                cost=cost+4;
+    k=seq.size()-out.size();
+    seq.swap(out);
 
-                hadamard[current]=false;
-                hadamard[next]=false;
-                hadamard[dest]=false;
-            }
+    return k;
+}
 
-            else if(!archMatrix[current][next] && !archMatrix[next][dest])
-            {
-                cost=cost+10;
 
-                if(hadamard[current])
-                    cost=cost-2;
-                else
-                    hadamard[current]=true;
+void PrintSeq(vector<vector<int>> seq)
+{
+    cout << "Dependency Sequence:"<< endl;
 
-                if(hadamard[next])
-                    cost=cost-2;
-                else
-                    hadamard[next]=true;
+    for(unsigned int i=0; i<seq.size(); i++)
+        cout << "( " << seq[i][0] << " , " << seq[i][1] << " )" <<endl;
+}
 
-                if(hadamard[dest])
-                    cost=cost-2;
-                else
-                    hadamard[dest]=true;
-            }
 
-            else if(archMatrix[current][next] && !archMatrix[next][dest])
-            {
-                cost=cost+10;
+/*
+ * Routes one corpus circuit with both allocators and writes its report block.
+ * The block is the unit a sharded run stores and the merge tool reorders.
+ */
+void RouteBatchCircuit(HardwareC& archA,HardwareD& archB,const BatchOptions& options,string name,const PackedSeq& circuit,ostream& os)
+{
+    float costA,costB;
+    int removed=0;
+    chrono::steady_clock::time_point starttime,endtime;
+    PackedSeq packed=circuit;
+    AllocReport report;
 
-                hadamard[current]=false;
+    cout << name << endl;
 
-                if(hadamard[next])
-                {
-                    cost=cost-2;
-                    hadamard[next]=false;
-                }
+    if(options.peephole)
+        removed=Peephole(packed);
 
-                if(hadamard[dest])
-                    cost=cost-2;
-                else
-                    hadamard[dest]=true;
-            }
+    archA.InitMap(circuit);
+    costA=archA.Alloc(packed);
 
-            else
-            {
-                cost=cost+10;
+    archB.InitMap(circuit);
 
-                if(hadamard[current])
-                    cost=cost-2;
-                else
-                    hadamard[current]=true;
+    starttime=chrono::steady_clock::now();
 
-                hadamard[next]=true;
+    if(options.budgeted)
+        costB=archB.Alloc(packed,options.budget,report);
+    else
+        costB=archB.Alloc(packed);
+
+    endtime=chrono::steady_clock::now();
+
+    os << name << ":" << endl;
+    os << "Length of the sequence:" << circuit.size()<< endl;
+    if(options.peephole)
+        os << "Gates removed by peephole: " << removed << endl;
+    os << "Total Cost of HardwareA is: " << costA << endl;
+    os << "Total Cost of HardwareB is: " << costB << endl;
+    os << "Execution Time of B is: " << chrono::duration<double>(endtime-starttime).count() << endl;
+    os << "costB / costA = " << costB/costA << endl;
+    if(options.budgeted)
+        os << "Search of B: windows " << report.windows << ", capped " << report.cappedWindows
+           << ", SubAlloc " << report.subAllocs << ", min readahead " << report.minReadahead
+           << (report.exhausted?", budget exhausted":"") << endl;
+    os << endl;
+}
 
-                hadamard[dest]=false;
-            }
-        }
 
-    }
+/*
+ * Header shared by every shard of one run. The corpus line hashes the sorted
+ * names and sizes, so shards of different corpora or options never merge.
+ */
+static string ShardHeader(const BatchOptions& options,const vector<string>& fileList,const vector<long long>& sizes,int shardNum)
+{
+    ostringstream os;
+    uint64_t hash=0xcbf29ce484222325ULL;
 
-    if(cost<mincost)
+    for(unsigned int i=0; i<fileList.size(); i++)
     {
-        mincost=cost;
-        minmap=mapArray;
-        minhadamard=hadamard;
+        string key=fileList[i]+"\n"+to_string(sizes[i])+"\n";
+        hash=Fnv1a(hash,key.data(),key.size());
     }
+
+    os << "QAX shard 1" << endl;
+    os << "shards " << shardNum << endl;
+    os << "options peephole " << options.peephole << " seconds " << options.budget.seconds
+       << " work " << (options.budgeted?options.budget.work:0) << " window " << options.windowTarget << endl;
+    os << "corpus " << fileList.size() << " " << hex << hash << dec << endl;
+
+    return os.str();
 }
 
-class HardwareD:public HardwareC
+
+/*
+ * Reads the records of a shard file into blocks (index -> report text).
+ * Returns the byte offset just past the last complete record, or -1 when the
+ * header does not match; a trailing partial record is left for the caller.
+ * A file that stops inside the header expected for shard is a worker that
+ * died before writing it, and counts as empty.
+ */
+static long long ReadShard(string fname,const string& header,int& shard,map<int,string>& blocks)
 {
-protected:
-    vector<int> sgateNum;
+    ifstream is(fname,ios::in|ios::binary);
+    string line,text,name,start;
+    long long good;
+    int index;
 
-public:
-    HardwareD(string hwname,bool isUniDirection);
+    if(!is)
+        return 0;
 
-    float Alloc(vector<vector<int>> seq);
+    start=header+"shard "+to_string(shard)+"\n";
+    text.resize(start.size());
+    is.read(&text[0],text.size());
+    text.resize(is.gcount());
+    if(text.size()<start.size() && start.compare(0,text.size(),text)==0)
+        return 0;
 
-    void SubAlloc(vector<vector<int>> worklist,vector<int> mapArray,vector<bool> hadamard,vector<bool>& minhadamard,vector<int>& minmap,vector<int>& minsgateNum,float& mincost);
-};
+    is.clear();
+    is.seekg(0);
+    text.clear();
 
-HardwareD::HardwareD(string hwname,bool isUniDirection=true):HardwareC(hwname,isUniDirection)
-{
-    for(int i=0; i<qubitNum; i++)
-        sgateNum.push_back(0);
+    for(unsigned int i=0,n=count(header.begin(),header.end(),'\n'); i<n; i++)
+    {
+        getline(is,line);
+        text+=line+"\n";
+    }
+    if(text!=header || !getline(is,line) || sscanf(line.c_str(),"shard %d",&shard)!=1)
+        return -1;
+
+    good=is.tellg();
+
+    while(getline(is,line) && sscanf(line.c_str(),"circuit %d",&index)==1)
+    {
+        text.clear();
+        while(getline(is,line) && line!="end")
+            text+=line+"\n";
+        if(line!="end" || is.eof())
+            break;
+        blocks[index]=text;
+        good=is.tellg();
+    }
+
+    return good;
 }
 
-float HardwareD::Alloc(vector<vector<int>> seq)
+
+/*
+ * Routes this shard's part of the corpus. Files are dealt largest first to
+ * the least loaded shard, so every worker derives the same balanced
+ * partition from the directory alone. Records are flushed one circuit at a
+ * time; rerunning a crashed shard keeps its complete records and resumes.
+ */
+int RunShard(HardwareC& archA,HardwareD& archB,const BatchOptions& options,const vector<string>& fileList,int shard,int shardNum,string outname)
 {
-    int i,j;
-    int m,n,seqLen,permuteNum,record,cnt;
-    float mincost,totalcost=0;
-    bool flag=false;
-    vector<vector<int>> worklist;
-    vector<int> minmap;
-    vector<int> minsgateNum;
-    vector<int> temp;
-    vector<bool> hadamard(qubitNum,false);
-    vector<bool> minhadamard;
-    vector<bool> seqitem(seq.size(),true);
-    vector<bool> vacant(qubitNum,true);
+    vector<long long> sizes(fileList.size(),0),load(shardNum,0);
+    vector<int> order(fileList.size()),owner(fileList.size());
+    map<int,string> blocks;
+    string header;
+    long long good;
+    int k,prevShard=shard;
+    struct stat st;
+
+    for(unsigned int i=0; i<fileList.size(); i++)
+    {
+        if(stat(("seq/"+fileList[i]).c_str(),&st)==0)
+            sizes[i]=st.st_size;
+        order[i]=i;
+    }
 
-    record=seq.size();
-    cnt=0;
+    stable_sort(order.begin(),order.end(),[&](int a,int b) {return sizes[a]>sizes[b];});
 
-    for(i=0; i<seq.size();i++)
+    for(unsigned int i=0; i<order.size(); i++)
     {
-        if(flag)
-            cnt++;
+        k=min_element(load.begin(),load.end())-load.begin();
+        owner[order[i]]=k;
+        load[k]+=sizes[order[i]];
+    }
 
-        if(seq[i][0]==-1 && seqitem[i])
-        {
-            if(vacant[seq[i][1]])
-            {
-                for(j=0; j<qubitNum; j++)
-                {
-                    if(mapArray[j]==seq[i][1])
-                        break;
-                }
+    header=ShardHeader(options,fileList,sizes,shardNum);
+    good=ReadShard(outname,header,prevShard,blocks);
 
-                sgateNum[j]++;
+    if(good<0 || prevShard!=shard)
+    {
+        cout << outname << " belongs to a different run; refusing to resume." << endl;
+        return 1;
+    }
 
-                hadamard[j]=false;
+    if(good==0)
+    {
+        ofstream init(outname,ios::out);
+        init << header << "shard " << shard << endl;
+    }
+    else if(truncate(outname.c_str(),good)!=0)
+    {
+        cout << "Cannot truncate " << outname << "." << endl;
+        return 1;
+    }
 
-                seqitem[i]=false;
-            }
+    ofstream os(outname,ios::out|ios::app);
+    SeqPrefetcher prefetch;
+    PackedSeq circuit;
+    vector<int> pending;
 
-            else if(record>i)
-            {
-                record=i;
-                flag=true;
-            }
-        }
+    for(unsigned int i=0; i<fileList.size(); i++)
+        if(owner[i]==shard && !blocks.count(i))
+            pending.push_back(i);
 
-        else if(seq[i][0]==-2 && seqitem[i])
-        {
-            if(vacant[seq[i][1]])
-            {
-                for(j=0; j<qubitNum; j++)
-                {
-                    if(mapArray[j]==seq[i][1])
-                        break;
-                }
+    if(pending.size())
+        prefetch.Start("seq/"+fileList[pending[0]]);
 
-                if(hadamard[j])
-                {
-                    totalcost=totalcost-crosstalk[j];
-                    hadamard[j]=false;
-                }
+    for(unsigned int p=0; p<pending.size(); p++)
+    {
+        int i=pending[p];
 
-                else
-                {
-                    sgateNum[j]++;
+        prefetch.Take(circuit);
+        if(p+1<pending.size())
+            prefetch.Start("seq/"+fileList[pending[p+1]]);
 
-                    hadamard[j]=true;
-                }
+        ostringstream block;
+        RouteBatchCircuit(archA,archB,options,fileList[i],circuit,block);
 
-                seqitem[i]=false;
-            }
+        os << "circuit " << i << " " << fileList[i] << endl << block.str() << "end" << endl;
+        os.flush();
+    }
 
-            else if(record>i)
-            {
-                record=i;
-                flag=true;
-            }
-        }
+    return os.good()?0:1;
+}
 
-        else if(seq[i][0]>=0 && seqitem[i])
-        {
-            if(vacant[seq[i][0]] && vacant[seq[i][1]])
-            {
-                worklist.push_back(seq[i]);
-                vacant[seq[i][0]]=false;
-                vacant[seq[i][1]]=false;
-                seqitem[i]=false;
-            }
 
-            else if(record>i)
+/*
+ * Combines complete shard files into the report a single-process run writes:
+ * blocks in corpus order, with every shard and every circuit present once.
+ */
+int RunMerge(int argc,char* argv[])
+{
+    string outname,header,line;
+    vector<string> shardFiles;
+    map<int,string> blocks;
+    vector<bool> seen;
+    unsigned int circuits=0;
+    int shard,shardNum=0;
+
+    for(int i=2; i<argc; i++)
+    {
+        if(string(argv[i])=="-o" && i+1<argc)
+            outname=argv[++i];
+        else
+            shardFiles.push_back(argv[i]);
+    }
+
+    if(outname.empty() || shardFiles.empty())
+    {
+        cout << "Usage: QAX merge -o report shard..." << endl;
+        return 1;
+    }
+
+    for(unsigned int f=0; f<shardFiles.size(); f++)
+    {
+        ifstream is(shardFiles[f],ios::in);
+        string text;
+
+        for(int i=0; i<4 && getline(is,line); i++)
+            text+=line+"\n";
+
+        if(f==0)
+        {
+            header=text;
+            if(sscanf(header.c_str(),"QAX shard 1\nshards %d",&shardNum)!=1 || shardNum<=0
+               || sscanf(header.substr(header.find("corpus ")).c_str(),"corpus %u",&circuits)!=1)
             {
-                record=i;
-                flag=true;
+                cout << shardFiles[f] << " is not a shard file." << endl;
+                return 1;
             }
+            seen.assign(shardNum,false);
         }
 
-        if(cnt>=Readahead || i==seq.size()-1)
+        shard=-1;
+        if(text!=header || ReadShard(shardFiles[f],header,shard,blocks)<0 || shard<0 || shard>=shardNum || seen[shard])
         {
-            if(worklist.size())
-            {
-                mincost=infinity;
-                seqLen=worklist.size();
+            cout << shardFiles[f] << " does not fit the other shards." << endl;
+            return 1;
+        }
+        seen[shard]=true;
+    }
+
+    if(count(seen.begin(),seen.end(),false) || blocks.size()!=circuits)
+    {
+        cout << "Shards are incomplete: " << blocks.size() << " of " << circuits << " circuits." << endl;
+        return 1;
+    }
 
-                if(seqLen==1)
-                    SubAlloc(worklist,mapArray,hadamard,minhadamard,minmap,minsgateNum,mincost);
+    ofstream os(outname,ios::out);
 
-                else
-                {
-                    permuteNum=frac(seqLen);
-                    m=0;
-                    while(m<permuteNum)
-                    {
-                        for(n=seqLen-1; n>0; n--)
-                        {
-                            temp=worklist[n];
-                            worklist[n]=worklist[n-1];
-                            worklist[n-1]=temp;
-                            m++;
-                            SubAlloc(worklist,mapArray,hadamard,minhadamard,minmap,minsgateNum,mincost);
-                        }
-
-                        temp=worklist[seqLen-1];
-                        worklist[seqLen-1]=worklist[seqLen-2];
-                        worklist[seqLen-2]=temp;
-                        m++;
-                        SubAlloc(worklist,mapArray,hadamard,minhadamard,minmap,minsgateNum,mincost);
-
-                        for(n=0; n<seqLen-1; n++)
-                        {
-                            temp=worklist[n];
-                            worklist[n]=worklist[n+1];
-                            worklist[n+1]=temp;
-                            m++;
-                            SubAlloc(worklist,mapArray,hadamard,minhadamard,minmap,minsgateNum,mincost);
-                        }
-
-                        temp=worklist[0];
-                        worklist[0]=worklist[1];
-                        worklist[1]=temp;
-                        m++;
-                        SubAlloc(worklist,mapArray,hadamard,minhadamard,minmap,minsgateNum,mincost);
-                    }
-                }
+    for(auto it=blocks.begin(); it!=blocks.end(); it++)
+        os << it->second;
 
-                mapArray=minmap;
-                hadamard=minhadamard;
-                sgateNum=minsgateNum;
-                totalcost=totalcost+mincost;
-                worklist.clear();
-            }
+    return os.good()?0:1;
+}
 
-            for(j=0;j<qubitNum;j++)
-                vacant[j]=true;
 
-            i=record-1;
-            record=seq.size();
-            cnt=0;
-            flag=false;
-        }
+int GetSeqList(vector<string> &fileList, string directory)
+{
+    directory = directory.append("/");
+
+    DIR *p_dir;
+    const char* str = directory.c_str();
+
+    p_dir = opendir(str);
+    if( p_dir == NULL)
+    {
+        cout<< "can't open :" << directory << endl;
     }
 
-    for(j=0;j<qubitNum;j++)
-        if(sgateNum[j]!=0)
+    struct dirent *p_dirent;
+
+    while ( p_dirent = readdir(p_dir))
+    {
+        string tmpFileName = p_dirent->d_name;
+        if( tmpFileName == "." || tmpFileName == "..")
         {
-            totalcost=totalcost+crosstalk[j]*sgateNum[j];
-            sgateNum[j]=0;
+            continue;
+        }
+        else
+        {
+            fileList.push_back(tmpFileName);
         }
+    }
+    closedir(p_dir);
 
-    return totalcost;
+    sort(fileList.begin(),fileList.end());
+
+    return fileList.size();
 }
 
 
-void HardwareD::SubAlloc(vector<vector<int>> worklist,vector<int> mapArray,vector<bool> hadamard,vector<bool>& minhadamard,vector<int>& minmap,vector<int>& minsgateNum,float& mincost)
+int RunDaemon(int argc,char* argv[])
 {
-    unsigned int i;
-    int j,beg,current,next,dest,temp;
-    float minsgc,cost=0;
-    vector<int> sgateNumCopy=sgateNum;
+    string socketPath="/tmp/qax.sock";
+    string deviceDir=".";
+    int workerNum=thread::hardware_concurrency();
+    int queueLimit=64;
+
+    if(argc>2)
+        socketPath=argv[2];
+    if(argc>3)
+        workerNum=atoi(argv[3]);
+    if(argc>4)
+        queueLimit=atoi(argv[4]);
+    if(argc>5)
+        deviceDir=argv[5];
+
+    if(workerNum<1)
+        workerNum=1;
+    if(queueLimit<1)
+        queueLimit=1;
+
+    signal(SIGPIPE,SIG_IGN);
+
+    RouteServer server(workerNum,queueLimit,deviceDir);
+    if(!server.Listen(socketPath))
+        return 1;
 
-    for(i=0; i<worklist.size(); i++)
-    {
-        for(j=0; j<qubitNum; j++)
-        {
-            if(mapArray[j]==worklist[i][0])
-                beg=j;
+    cout << "Listening on " << socketPath << " with " << workerNum << " workers, devices from " << deviceDir << endl;
+    server.Run();
 
-            if(mapArray[j]==worklist[i][1])
-                dest=j;
-        }
+    return 0;
+}
 
-        cost=cost+crosstalk[dest]*sgateNumCopy[dest];
-        sgateNumCopy[dest]=0;
 
-        minsgc=crosstalk[beg];
+int RunFused(int argc,char* argv[])
+{
+    vector<vector<int>> seq;
+    UniformCost uniform;
+    CrosstalkCost crosstalk;
+    vector<CostAccumulator*> accumulators;
 
-        next=routeMatrix[beg][dest];
+    accumulators.push_back(&uniform);
+    accumulators.push_back(&crosstalk);
 
-        if(next==dest)
-        {
-            if(archMatrix[beg][next])
-            {
-                cost++;
-                hadamard[beg]=false;
-                hadamard[next]=false;
-            }
+    HardwareFused arch("ibmqx5");
 
-            else
-            {
-                cost=cost+5;
+    for(int i=2; i<argc; i++)
+    {
+        GetSeq(seq,argv[i]);
 
-                if(hadamard[beg])
-                    cost=cost-2;
-                else
-                    hadamard[beg]=true;
+        arch.InitMap(seq);
+        arch.Alloc(seq,accumulators);
 
-                if(hadamard[next])
-                    cost=cost-2;
-                else
-                    hadamard[next]=true;
-            }
-        }
+        cout << argv[i] << ": uniform " << uniform.GetCost() << " crosstalk " << crosstalk.GetCost() << endl;
+    }
 
-        else
-        {
-            current=beg;
+    return 0;
+}
 
-            while(routeMatrix[next][dest]!=dest)
-            {
-                temp=mapArray[current];
-                mapArray[current]=mapArray[next];
-                mapArray[next]=temp;
 
-                cost=cost+7;
+int RunLookahead(int argc,char* argv[])
+{
+    float costD,costE,sumD=0,sumE=0;
+    double timeD,timeE;
+    clock_t starttime;
+    string directory="seq";
+    vector<string> fileList;
+    vector<vector<int>> seq;
+    PackedSeq packed;
 
-                hadamard[current]=false;
-                hadamard[next]=false;
+    HardwareD archD("ibmqx5");
+    HardwareE archE("ibmqx5");
 
-                current=next;
-                next=routeMatrix[current][dest];
+    if(argc>2)
+        for(int i=2; i<argc; i++)
+            fileList.push_back(argv[i]);
+    else
+    {
+        GetSeqList(fileList,directory);
+        for(unsigned int i=0; i<fileList.size(); i++)
+            fileList[i]=directory+"/"+fileList[i];
+    }
 
-                if(crosstalk[current]<minsgc)
-                    minsgc=crosstalk[current];
-            }
+    for(unsigned int i=0; i<fileList.size(); i++)
+    {
+        GetSeq(seq,fileList[i]);
+        PackSeq(packed,seq);
 
-            if(archMatrix[current][next] && archMatrix[next][dest])
-            {
-                cost=cost+4;
+        archD.InitMap(seq);
+        starttime=clock();
+        costD=archD.Alloc(packed);
+        timeD=(double)(clock()-starttime)/CLOCKS_PER_SEC;
 
-                hadamard[current]=false;
-                hadamard[next]=false;
-                hadamard[dest]=false;
-            }
+        archE.InitMap(seq);
+        starttime=clock();
+        costE=archE.Alloc(packed);
+        timeE=(double)(clock()-starttime)/CLOCKS_PER_SEC;
 
-            else if(!archMatrix[current][next] && !archMatrix[next][dest])
-            {
-                cost=cost+10;
+        sumD=sumD+costD;
+        sumE=sumE+costE;
 
-                if(hadamard[current])
-                    cost=cost-2;
-                else
-                    hadamard[current]=true;
+        cout << fileList[i] << ": length " << seq.size() << " costD " << costD << " timeD " << timeD
+             << " costE " << costE << " timeE " << timeE << " costE / costD = " << costE/costD << endl;
+    }
 
-                if(hadamard[next])
-                    cost=cost-2;
-                else
-                    hadamard[next]=true;
+    cout << "Corpus costE / costD = " << sumE/sumD << endl;
 
-                if(hadamard[dest])
-                    cost=cost-2;
-                else
-                    hadamard[dest]=true;
-            }
+    return 0;
+}
 
-            else if(archMatrix[current][next] && !archMatrix[next][dest])
-            {
-                cost=cost+10;
 
-                hadamard[current]=false;
+int RunExact(int argc,char* argv[])
+{
+    float costC,costExact;
+    long nodeLimit=1000000;
+    long memLimit=512;
+    int first=2;
+    vector<vector<int>> seq;
 
-                if(hadamard[next])
-                {
-                    cost=cost-2;
-                    hadamard[next]=false;
-                }
+    while(first+1<argc && argv[first][0]=='-')
+    {
+        if(string(argv[first])=="-n")
+            nodeLimit=atol(argv[first+1]);
+        else if(string(argv[first])=="-m")
+            memLimit=atol(argv[first+1]);
+        first=first+2;
+    }
 
-                if(hadamard[dest])
-                    cost=cost-2;
-                else
-                    hadamard[dest]=true;
-            }
+    HardwareC archC("ibmqx5");
+    HardwareExact archX("ibmqx5");
 
-            else
-            {
-                cost=cost+10;
+    archX.SetLimits(nodeLimit,(size_t)memLimit<<20);
 
-                if(hadamard[current])
-                    cost=cost-2;
-                else
-                    hadamard[current]=true;
+    for(int i=first; i<argc; i++)
+    {
+        GetSeq(seq,argv[i]);
 
-                hadamard[next]=true;
+        archC.InitMap(seq);
+        costC=archC.Alloc(seq);
 
-                hadamard[dest]=false;
-            }
-        }
+        archX.InitMap(seq);
+        costExact=archX.Alloc(seq);
 
-        cost=cost+minsgc*sgateNumCopy[beg];
-        sgateNumCopy[beg]=0;
-    }
+        const ExactReport& report=archX.GetReport();
 
-    if(cost<mincost)
-    {
-        mincost=cost;
-        minmap=mapArray;
-        minhadamard=hadamard;
-        minsgateNum=sgateNumCopy;
+        cout << argv[i] << ": costC " << costC;
+        if(report.optimal)
+            cout << " optimal " << costExact << " costC / optimal = " << costC/costExact;
+        else
+            cout << " limit reached, lower bound " << report.bound;
+        cout << " expanded " << report.expanded << " stored " << report.stored
+             << " nodes/s " << report.expanded/(report.seconds>0?report.seconds:1e-9) << endl;
     }
+
+    return 0;
 }
 
 
-void RandSeqGen(vector<vector<int>> &seq,int qubitNum,int seqLen);
+/*
+ * Routes every circuit against every device. Circuits are parsed and packed
+ * once, devices are built once and cloned once per worker thread, and the
+ * (circuit, device) pairs are shared out through an atomic counter. Devices
+ * without a crosstalk file are routed with zero crosstalk.
+ */
+int RunSweep(int argc,char* argv[])
+{
+    unsigned int c,d,j;
+    int threadNum=thread::hardware_concurrency();
+    vector<string> devices,circuits;
+    vector<vector<vector<int>>> seqs;
+    vector<PackedSeq> packed;
+    vector<int> logicalNum;
+    vector<HardwareD*> protos;
+    vector<thread> workers;
+    DeviceOptions options;
+    atomic<unsigned int> nextTask(0);
+
+    for(int i=2; i<argc; i++)
+    {
+        if(string(argv[i])=="-d" && i+1<argc)
+            devices.push_back(argv[++i]);
+        else if(string(argv[i])=="-j" && i+1<argc)
+            threadNum=atoi(argv[++i]);
+        else if(string(argv[i])=="-c" && i+1<argc)
+            options.cacheDir=argv[++i];
+        else
+            circuits.push_back(argv[i]);
+    }
 
-void GetSeq(vector<vector<int>> &seq,string fname);
+    if(devices.empty() || circuits.empty())
+    {
+        cout << "Usage: QAX sweep -d device [-d device ...] [-j threads] [-c cachedir] circuit ..." << endl;
+        return 1;
+    }
 
-void PrintSeq(vector<vector<int>> seq);
+    if(threadNum<1)
+        threadNum=1;
 
-int GetSeqList(vector<string> &fileList, string directory);
+    seqs.resize(circuits.size());
+    packed.resize(circuits.size());
+    logicalNum.assign(circuits.size(),0);
 
-int main()
-{
-    float costA,costB;
-    int fcount,scount;
-    clock_t starttime,endtime;
+    for(c=0; c<circuits.size(); c++)
+    {
+        GetSeq(seqs[c],circuits[c]);
+        PackSeq(packed[c],seqs[c]);
 
-    HardwareC archA("ibmqx5");
-    HardwareD archB("ibmqx5");
+        for(j=0; j<seqs[c].size(); j++)
+            logicalNum[c]=max(logicalNum[c],max(seqs[c][j][0],seqs[c][j][1])+1);
+    }
 
-    vector<string> fileList;
-    vector<vector<int>> seq;
+    options.zeroCrosstalk=true;
 
-    string directory="/home/tilmto/CodeBlocks/QAErrorModel/seq";
-    fcount=GetSeqList(fileList,directory);
+    for(d=0; d<devices.size(); d++)
+        protos.push_back(new HardwareD(devices[d],true,false,options));
 
-    ofstream os("/home/tilmto/Ericpy/QuantumComputing/bridge/result",ios::out);
+    unsigned int taskNum=circuits.size()*devices.size();
+    vector<float> cost(taskNum,0);
+    vector<double> seconds(taskNum,0);
+    vector<char> routed(taskNum,0);
 
-    for(int i=0; i<fcount; i++)
-    {
-        GetSeq(seq,"seq/"+fileList[i]);
+    for(int t=0; t<threadNum; t++)
+        workers.push_back(thread([&]()
+        {
+            unsigned int task;
+            map<unsigned int,HardwareD> local;
+            map<unsigned int,HardwareD>::iterator it;
+            chrono::steady_clock::time_point starttime;
 
-        cout << fileList[i] << endl;
+            while((task=nextTask++)<taskNum)
+            {
+                unsigned int dev=task%devices.size();
+                unsigned int circ=task/devices.size();
 
-        archA.InitMap(seq);
-        costA=archA.Alloc(seq);
+                if(logicalNum[circ]>protos[dev]->GetQNum())
+                    continue;
 
-        archB.InitMap(seq);
+                it=local.find(dev);
+                if(it==local.end())
+                    it=local.insert(make_pair(dev,*protos[dev])).first;
 
-        starttime=clock();
+                starttime=chrono::steady_clock::now();
+                it->second.InitMap(seqs[circ]);
+                cost[task]=it->second.Alloc(packed[circ]);
+                seconds[task]=chrono::duration<double>(chrono::steady_clock::now()-starttime).count();
+                routed[task]=1;
+            }
+        }));
 
-        costB=archB.Alloc(seq);
+    for(j=0; j<workers.size(); j++)
+        workers[j].join();
 
-        endtime=clock();
+    cout << "circuit";
+    for(d=0; d<devices.size(); d++)
+        cout << "\t" << devices[d] << " cost\t" << devices[d] << " time";
+    cout << '\n';
 
-        os << fileList[i] << ":" << endl;
-        os << "Length of the sequence:" << seq.size()<< endl;
-        os << "Total Cost of HardwareA is: " << costA << endl;
-        os << "Total Cost of HardwareB is: " << costB << endl;
-        os << "Execution Time of B is: " << (double)(endtime-starttime)/CLOCKS_PER_SEC << endl;
-        os << "costB / costA = " << costB/costA << endl;
-        os << endl;
+    for(c=0; c<circuits.size(); c++)
+    {
+        cout << circuits[c];
+        for(d=0; d<devices.size(); d++)
+        {
+            if(!routed[c*devices.size()+d])
+                cout << "\tn/a\tn/a";
+            else
+                cout << "\t" << cost[c*devices.size()+d] << "\t" << seconds[c*devices.size()+d];
+        }
+        cout << '\n';
     }
+    cout.flush();
 
-    os.close();
+    for(d=0; d<protos.size(); d++)
+        delete protos[d];
 
     return 0;
 }
 
 
-void RandSeqGen(vector<vector<int>> &seq,int qubitNum,int seqLen)
+/*
+ * Evaluates a grid of cost models over a set of circuits in one process.
+ * Every list option multiplies the grid; circuits are parsed once and each
+ * worker keeps one clone of the device, switching models with SetCostModel.
+ */
+int RunParamSweep(int argc,char* argv[])
 {
-    int cqubit,squbit;
-    int i=0;
-    srand((int)time(0));
-
-    while(i<seqLen)
+    unsigned int c,g,j,k;
+    int threadNum=thread::hardware_concurrency();
+    string hwname="ibmqx5",outname,directory="seq";
+    vector<string> circuits;
+    vector<vector<vector<int>>> seqs;
+    vector<PackedSeq> packed;
+    vector<CostModel> grid(1);
+    vector<thread> workers;
+    atomic<unsigned int> nextTask(0);
+    const char* names[]={"--cof","--readahead","--cx","--cxrev","--bridge","--bridgerev","--swap","--credit","--window","--scan"};
+
+    for(int i=2; i<argc; i++)
     {
-        cqubit=rand()%qubitNum;
-        squbit=rand()%qubitNum;
-        if(cqubit!=squbit)
+        string arg=argv[i];
+
+        if(arg=="-d" && i+1<argc)
+            hwname=argv[++i];
+        else if(arg=="-j" && i+1<argc)
+            threadNum=atoi(argv[++i]);
+        else if(arg=="-o" && i+1<argc)
+            outname=argv[++i];
+        else if(arg.size()>2 && arg[0]=='-' && arg[1]=='-' && i+1<argc)
         {
-            seq.push_back(vector<int>(2));
-            seq[i][0]=cqubit;
-            seq[i][1]=squbit;
-            i++;
-        }
-    }
-}
+            for(k=0; k<10; k++)
+                if(arg==names[k])
+                    break;
 
+            if(k==10)
+            {
+                cout << "Unknown parameter " << arg << endl;
+                return 1;
+            }
 
-void GetSeq(vector<vector<int>> &seq,string fname)
-{
-    int i=0;
-    int first,second;
+            vector<double> values;
+            string list=argv[++i];
+            size_t pos=0;
+            while(pos<=list.size())
+            {
+                size_t comma=list.find(',',pos);
+                if(comma==string::npos)
+                    comma=list.size();
+                values.push_back(atof(list.substr(pos,comma-pos).c_str()));
+                pos=comma+1;
+            }
 
-    seq.clear();
+            vector<CostModel> expanded;
+            for(g=0; g<grid.size(); g++)
+                for(j=0; j<values.size(); j++)
+                {
+                    CostModel model=grid[g];
+                    int v=(int)values[j];
 
-    ifstream is(fname,ios::in);
+                    switch(k)
+                    {
+                    case 0: model.ctScale=values[j]; break;
+                    case 1: model.readahead=v; break;
+                    case 2: model.cx=v; break;
+                    case 3: model.cxReversed=v; break;
+                    case 4: model.bridge=v; break;
+                    case 5: model.bridgeReversed=v; break;
+                    case 6: model.swap=v; break;
+                    case 7: model.hadamardCredit=v; break;
+                    case 8: model.windowTarget=v; break;
+                    case 9: model.windowScan=v; break;
+                    }
 
-    if(!is)
-    {
-        cout << "No such seq file." << endl;
-        exit(1);
+                    expanded.push_back(model);
+                }
+            grid.swap(expanded);
+        }
+        else
+            circuits.push_back(arg);
     }
 
-    while(!is.eof())
+    if(circuits.empty())
     {
-        is >> first;
-        is >> second;
+        GetSeqList(circuits,directory);
+        for(c=0; c<circuits.size(); c++)
+            circuits[c]=directory+"/"+circuits[c];
+    }
+
+    if(threadNum<1)
+        threadNum=1;
 
-        seq.push_back(vector<int>(2));
-        seq[i][0]=first;
-        seq[i][1]=second;
-        i++;
+    seqs.resize(circuits.size());
+    packed.resize(circuits.size());
+    for(c=0; c<circuits.size(); c++)
+    {
+        GetSeq(seqs[c],circuits[c]);
+        PackSeq(packed[c],seqs[c]);
     }
 
-    seq.pop_back();
+    HardwareD proto(hwname);
 
-    is.close();
+    unsigned int taskNum=circuits.size()*grid.size();
+    vector<float> cost(taskNum,0);
+    vector<double> seconds(taskNum,0);
 
-}
+    for(int t=0; t<threadNum; t++)
+        workers.push_back(thread([&]()
+        {
+            unsigned int task;
+            HardwareD arch=proto;
+            chrono::steady_clock::time_point starttime;
 
+            while((task=nextTask++)<taskNum)
+            {
+                arch.SetCostModel(grid[task%grid.size()]);
 
-void PrintSeq(vector<vector<int>> seq)
-{
-    cout << "Dependency Sequence:"<< endl;
+                starttime=chrono::steady_clock::now();
+                arch.InitMap(seqs[task/grid.size()]);
+                cost[task]=arch.Alloc(packed[task/grid.size()]);
+                seconds[task]=chrono::duration<double>(chrono::steady_clock::now()-starttime).count();
+            }
+        }));
 
-    for(unsigned int i=0; i<seq.size(); i++)
-        cout << "( " << seq[i][0] << " , " << seq[i][1] << " )" <<endl;
+    for(j=0; j<workers.size(); j++)
+        workers[j].join();
+
+    ofstream file;
+    if(outname.size())
+        file.open(outname,ios::out);
+    ostream& os=outname.size()?file:cout;
+
+    os << "circuit\tcof\treadahead\tcx\tcxrev\tbridge\tbridgerev\tswap\tcredit\twindow\tscan\tcost\ttime\n";
+    for(c=0; c<circuits.size(); c++)
+        for(g=0; g<grid.size(); g++)
+        {
+            const CostModel& model=grid[g];
+            os << circuits[c] << "\t" << model.ctScale << "\t" << model.readahead << "\t" << model.cx
+               << "\t" << model.cxReversed << "\t" << model.bridge << "\t" << model.bridgeReversed
+               << "\t" << model.swap << "\t" << model.hadamardCredit << "\t" << model.windowTarget << "\t" << model.windowScan
+               << "\t" << cost[c*grid.size()+g] << "\t" << seconds[c*grid.size()+g] << "\n";
+        }
+    os.flush();
+
+    return 0;
 }
 
 
-int GetSeqList(vector<string> &fileList, string directory)
+int RunGen(int argc,char* argv[])
 {
-    directory = directory.append("/");
+    GenSpec spec;
+    string outname,profile="random",hwname,tracename;
+    PackedSeq seq;
+    float cost;
 
-    DIR *p_dir;
-    const char* str = directory.c_str();
+    spec.threads=thread::hardware_concurrency();
 
-    p_dir = opendir(str);
-    if( p_dir == NULL)
+    for(int i=2; i<argc; i++)
     {
-        cout<< "can't open :" << directory << endl;
+        string arg=argv[i];
+
+        if(arg=="-o" && i+1<argc)
+            outname=argv[++i];
+        else if(arg=="-n" && i+1<argc)
+            spec.gates=atoll(argv[++i]);
+        else if(arg=="-q" && i+1<argc)
+            spec.qubits=atoi(argv[++i]);
+        else if(arg=="-s" && i+1<argc)
+            spec.seed=strtoull(argv[++i],NULL,10);
+        else if(arg=="-j" && i+1<argc)
+            spec.threads=atoi(argv[++i]);
+        else if(arg=="--single" && i+1<argc)
+            spec.singleFrac=atof(argv[++i]);
+        else if(arg=="--hadamard" && i+1<argc)
+            spec.hadamardFrac=atof(argv[++i]);
+        else if(arg=="--locality" && i+1<argc)
+            spec.locality=atoi(argv[++i]);
+        else if(arg=="--profile" && i+1<argc)
+            profile=argv[++i];
+        else if(arg=="--route" && i+1<argc)
+            hwname=argv[++i];
+        else if(arg=="--trace" && i+1<argc)
+            tracename=argv[++i];
+        else
+        {
+            cout << "Usage: QAX gen -o file -n gates [-q qubits] [-s seed] [-j threads] [--single f] [--hadamard f] "
+                 << "[--profile random|nn|layered] [--locality k] [--route device [--trace file]]" << endl;
+            return 1;
+        }
     }
 
-    struct dirent *p_dirent;
+    if(profile=="random")
+        spec.profile=GenRandom;
+    else if(profile=="nn")
+        spec.profile=GenNearest;
+    else if(profile=="layered")
+        spec.profile=GenLayered;
+    else
+    {
+        cout << "Unknown profile " << profile << "." << endl;
+        return 1;
+    }
 
-    while ( p_dirent = readdir(p_dir))
+    if(outname.empty() || spec.gates<=0 || spec.qubits<2 || spec.locality<1
+       || spec.singleFrac<0 || spec.hadamardFrac<0 || spec.singleFrac+spec.hadamardFrac>1)
     {
-        string tmpFileName = p_dirent->d_name;
-        if( tmpFileName == "." || tmpFileName == "..")
-        {
-            continue;
-        }
-        else
-        {
-            fileList.push_back(tmpFileName);
-        }
+        cout << "Invalid generator parameters." << endl;
+        return 1;
     }
-    closedir(p_dir);
 
-    return fileList.size();
+    auto starttime=chrono::steady_clock::now();
+
+    if(!GenSeqFile(spec,outname))
+    {
+        cout << "Cannot write " << outname << "." << endl;
+        return 1;
+    }
+
+    cout << "Generated " << spec.gates << " gates on " << spec.qubits << " qubits in "
+         << chrono::duration<double>(chrono::steady_clock::now()-starttime).count() << "s" << endl;
+
+    if(hwname.empty())
+        return 0;
+
+    HardwareC hc(hwname);
+
+    if(spec.qubits>hc.GetQNum())
+    {
+        cout << "Device has fewer qubits than the circuit." << endl;
+        return 1;
+    }
+
+    RouteSink sink(16,tracename);
+
+    if(tracename.size())
+        hc.SetSink(&sink);
+
+    starttime=chrono::steady_clock::now();
+    GetSeq(seq,outname);
+    hc.InitMap(seq);
+    cost=hc.Alloc(seq);
+
+    cout << "Cost of C: " << cost << endl;
+    cout << "Time of C: " << chrono::duration<double>(chrono::steady_clock::now()-starttime).count() << "s" << endl;
+    if(tracename.size())
+        cout << "Routed gates traced: " << sink.Emitted() << endl;
+
+    return 0;
 }
 
 
@@ -0,0 +1,73 @@
+/*
+ * Checkpoints taken from one initial layout must not be resumed from
+ * another. Build from the repository root with
+ *     g++ -O2 -pthread tests/checkpoint_layout.cpp -o checkpoint_layout
+ * and run it there; it exits non-zero on failure.
+ */
+#define main qax_main
+#include "../main.cpp"
+#undef main
+
+class LayoutHardware:public HardwareD
+{
+public:
+    LayoutHardware(string hwname):HardwareD(hwname) {}
+
+    void SetLayout(const vector<int>& layout)
+    {
+        mapArray=layout;
+    }
+};
+
+int main()
+{
+    int i,n,failed=0;
+    float fresh,resumed;
+    string error;
+    PackedSeq seq;
+    vector<int> identity,reversed;
+    vector<AllocCheckpoint> checkpoints;
+    LayoutHardware hw("ibmqx5");
+
+    if(ReadPairFile(seq,"seq/seq_4_49_16.qasm",error)<0)
+    {
+        cout << "Cannot read seq/seq_4_49_16.qasm: " << error << endl;
+        return 1;
+    }
+
+    n=hw.GetQNum();
+    for(i=0; i<n; i++)
+    {
+        identity.push_back(i);
+        reversed.push_back(n-1-i);
+    }
+
+    hw.SetLayout(identity);
+    hw.Alloc(seq,checkpoints,1);
+
+    hw.SetLayout(reversed);
+    fresh=hw.Alloc(seq);
+
+    hw.SetLayout(reversed);
+    resumed=hw.Alloc(seq,checkpoints,1);
+
+    if(resumed!=fresh)
+    {
+        cout << "FAIL: resumed " << resumed << " from a foreign layout, fresh run gives " << fresh << endl;
+        failed++;
+    }
+
+    hw.SetLayout(reversed);
+    resumed=hw.Alloc(seq,checkpoints,1);
+
+    if(resumed!=fresh)
+    {
+        cout << "FAIL: resuming own checkpoints gives " << resumed << ", fresh run gives " << fresh << endl;
+        failed++;
+    }
+
+    if(!failed)
+        cout << "PASS" << endl;
+
+    return failed?1:0;
+}
@@ -0,0 +1,58 @@
+/*
+ * Enabling a coupler that is not in the device file must be refused, since
+ * the two-hop patch can leave routes that never reach their target; file
+ * couplers must still toggle. Build from the repository root with
+ *     g++ -O2 -pthread tests/coupler_enable.cpp -o coupler_enable
+ * and run it there; it exits non-zero on failure.
+ */
+#define main qax_main
+#include "../main.cpp"
+#undef main
+
+void Timeout(int)
+{
+    const char message[]="FAIL: routing did not finish\n";
+
+    if(write(1,message,sizeof(message)-1)<0)
+        _exit(2);
+    _exit(1);
+}
+
+int main()
+{
+    int failed=0;
+    float cost;
+    vector<vector<int>> seq;
+    HardwareA hw("ibmqx5");
+
+    signal(SIGALRM,Timeout);
+    GetSeq(seq,"seq/seq_0410184_169.qasm");
+
+    if(hw.SetCoupler(10,8,true))
+    {
+        cout << "FAIL: enabled coupler 10->8, which the device file does not have" << endl;
+        failed++;
+    }
+
+    if(!hw.SetCoupler(1,2,false) || !hw.SetCoupler(1,2,true))
+    {
+        cout << "FAIL: cannot toggle file coupler 1->2" << endl;
+        failed++;
+    }
+
+    alarm(10);
+    hw.InitMap(seq);
+    cost=hw.Alloc(seq);
+    alarm(0);
+
+    if(cost<=0)
+    {
+        cout << "FAIL: cost " << cost << " after toggling couplers" << endl;
+        failed++;
+    }
+
+    if(!failed)
+        cout << "PASS" << endl;
+
+    return failed?1:0;
+}